@@ -3,10 +3,13 @@
 #include <arpa/inet.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stddef.h>
+#include <stdatomic.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -14,17 +17,104 @@
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
+#ifdef __APPLE__
+#include <mach/mach.h>
+/* Private xnu interface (bsd/sys/kern_memorystatus.h), not declared by the public SDK. */
+extern int memorystatus_control(uint32_t command, int32_t pid, uint32_t flags, void *buffer, size_t buffersize);
+#define LP_MEMORYSTATUS_CMD_SET_JETSAM_TASK_LIMIT 6
+#define LP_MEMORYSTATUS_CMD_GET_MEMLIMIT_PROPERTIES 8
+typedef struct {
+    int32_t memlimit_active; /* MB, -1 = none */
+    uint32_t memlimit_active_attr;
+    int32_t memlimit_inactive;
+    uint32_t memlimit_inactive_attr;
+} lp_memlimit_properties_t;
+#endif
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
 
 #define LP_MAX_HOST 255
 #define LP_MAX_TOKEN 255
 #define LP_HTTP_BUF 16384
 #define LP_MSG_BUF 256
 #define LP_UDP_BUF 65535
+#define LP_MAX_ROUTES 16
+#define LP_MATCH_HOST 64
+#define LP_PATH_BUF 512
+#define LP_ROUTES_JSON_BUF 16384
+#define LP_THREAD_STACK (256 * 1024)
+#define LP_RESOLVE_RETRY_MIN_SECS 2
+#define LP_RESOLVE_RETRY_MAX_SECS 60
+
+/* Session snapshot: two checksummed slots in one mmap'd file; the valid slot with the higher seq wins. */
+#define LP_SNAPSHOT_MAGIC 0x3153504Cu /* "LPS1" */
+#define LP_SNAPSHOT_VERSION 2
+#define LP_SNAPSHOT_SLOTS 2
+
+/* Tunnel wire format: [magic][ver<<4 | flags][raw_len:be16][time:be32][seq:be64] then records
+ * [type][channel:be16][len:be16][data], optionally LZ-compressed as a whole, then an
+ * 8-byte SipHash-2-4 tag (keyed by tunnelKey) over everything before it. */
+#define LP_TUNNEL_MAGIC 0x4C
+#define LP_TUNNEL_VERSION 3
+#define LP_TUNNEL_F_COMPRESSED 0x01
+#define LP_TUNNEL_HDR 16
+#define LP_TUNNEL_TAG 8
+#define LP_TUNNEL_KEY 16
+#define LP_TUNNEL_MAX_SKEW_SECS 30
+#define LP_TUNNEL_REC_HDR 5
+#define LP_TUNNEL_REC_DATA 1
+#define LP_TUNNEL_REC_OPEN 2
+#define LP_TUNNEL_MTU_MIN 576
+#define LP_TUNNEL_MTU_MAX 1472 /* 1500-byte Ethernet MTU minus IPv4 + UDP headers */
+#define LP_TUNNEL_OVERHEAD (LP_TUNNEL_HDR + LP_TUNNEL_TAG + LP_TUNNEL_REC_HDR)
+#define LP_TUNNEL_MAX_SESSIONS 64
+#define LP_TUNNEL_OPEN_INTERVAL_NS 1000000000ULL
+#define LP_TUNNEL_ACTIVE_NS 10000000000ULL /* links idle longer than this stop re-announcing */
+#define LP_TUNNEL_IDLE_SECS 120
+#define LP_TUNNEL_RETRY_MAX_SECS 60 /* cap on the backoff between failed session lookups */
+#define LP_TUNNEL_DICT_MAX 32768
+#define LP_LZ_HASH_BITS 12
+#define LP_LZ_MINMATCH 4
+#define LP_LZ_MFLIMIT 12
+#define LP_LZ_LASTLITERALS 5
+#define LP_LZ_MAX_OFFSET 65535
+
+/* Flight recorder: build with `make TRACE=1`; otherwise every LP_TP() compiles to nothing. */
+#ifndef LP_TRACE
+#define LP_TRACE 0
+#endif
+#define LP_TRACE_RING 4096 /* events per thread, power of two */
+#define LP_TRACE_MAX_THREADS 8
+
+typedef struct {
+    uint16_t listen_port;
+    char server_host[LP_MAX_HOST + 1];
+    uint16_t server_port;
+    char match_host[LP_MATCH_HOST];
+    uint16_t match_port;
+    struct sockaddr_storage server_addr; /* resolved off the relay thread; len 0 = not resolved */
+    socklen_t server_addr_len;
+} lp_route_t;
+
+typedef struct {
+    lp_route_t entries[LP_MAX_ROUTES]; /* sorted by listen_port */
+    size_t count;
+} lp_route_table_t;
+
+typedef enum {
+    LP_TUNNEL_OFF = 0,
+    LP_TUNNEL_CLIENT = 1,
+    LP_TUNNEL_SERVER = 2
+} lp_tunnel_mode_t;
 
 typedef struct {
     char device_id[128];
@@ -34,6 +124,22 @@ typedef struct {
     uint16_t local_proxy_port;
     char remote_default_host[LP_MAX_HOST + 1];
     uint16_t remote_default_port;
+    char routes_path[LP_PATH_BUF];
+    lp_route_table_t routes;
+    lp_tunnel_mode_t tunnel_mode;
+    char tunnel_peer_host[LP_MAX_HOST + 1];
+    uint16_t tunnel_peer_port;
+    char tunnel_bind_host[LP_MAX_HOST + 1];
+    uint16_t tunnel_listen_port;
+    unsigned char tunnel_key[LP_TUNNEL_KEY];
+    long tunnel_mtu;
+    long tunnel_batch_us;
+    int tunnel_compress;
+    unsigned char *tunnel_dict;
+    size_t tunnel_dict_len;
+    uint32_t tunnel_dict_id;
+    char snapshot_path[LP_PATH_BUF];
+    long memory_limit_mb;
 } lp_config_t;
 
 typedef enum {
@@ -47,34 +153,151 @@ typedef struct lp_relay_s lp_relay_t;
 
 typedef struct {
     pthread_mutex_t lock;
+    pthread_mutex_t ctl_lock; /* serialises relay start/stop between the control server and upkeep; taken before lock */
     lp_state_t state;
     char target_host[LP_MAX_HOST + 1];
     uint16_t target_port;
     char message[LP_MSG_BUF];
     time_t updated_at;
+    lp_route_table_t routes;
+    unsigned routes_gen;
     lp_relay_t *relay;
+    lp_relay_t *failed_relay; /* relay thread that exited on an error, not joined yet */
+    int want_running;         /* last start/stop request; upkeep restarts a relay that failed */
+    unsigned relay_failures;  /* consecutive relay failures since the last one that came up */
+    time_t relay_retry_at;
+    pthread_cond_t upkeep_cond; /* signalled with upkeep_kick set, or on shutdown */
+    int upkeep_kick;
+    int upkeep_stop;
 } lp_runtime_t;
 
+typedef struct {
+    atomic_ullong raw_bytes;
+    atomic_ullong wire_bytes;
+    atomic_ullong packets;
+    atomic_ullong drops;
+    atomic_ullong auth_failures;
+} lp_tunnel_stats_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;
+    uint32_t checksum; /* FNV-1a from `seq` to the end of the slot */
+    uint64_t seq;
+    uint32_t config_hash; /* lp_config_state_hash() of the config the snapshot was taken under */
+    uint32_t running;
+    uint16_t target_port;
+    char target_host[LP_MAX_HOST + 1];
+    lp_route_table_t routes;
+} lp_snapshot_slot_t;
+
+typedef struct {
+    lp_snapshot_slot_t *slots; /* mmap'd, LP_SNAPSHOT_SLOTS entries */
+    uint64_t seq;
+} lp_snapshot_t;
+
 typedef struct {
     lp_config_t cfg;
     lp_runtime_t rt;
+    lp_tunnel_stats_t tunnel;
+    lp_snapshot_t snap;
+    uint64_t memory_limit_bytes; /* limit actually in force; 0 = none or unknown */
+    pthread_t upkeep;
+    int upkeep_running;
 } lp_app_t;
 
-struct lp_relay_s {
+/* Per-thread tunnel codec; win holds the preset dictionary followed by the working block. */
+typedef struct {
     lp_app_t *app;
-    pthread_t thread;
-    volatile int stop_flag;
-    int wake_pipe[2];
-    int local_fd;
-    int remote_fd;
+    int compress;
+    size_t dict_len;
+    unsigned char *win;
+    uint32_t dict_hash[1u << LP_LZ_HASH_BITS];
+    uint32_t hash[1u << LP_LZ_HASH_BITS];
+    uint64_t tx_seq; /* last packet counter sent; seeded from the wall clock */
+    unsigned char pkt[LP_UDP_BUF];
+} lp_codec_t;
+
+/* Anti-replay state for one tunnel sender. */
+typedef struct {
+    uint64_t top;    /* highest authenticated packet counter */
+    uint64_t window; /* bit i set: counter top - i already seen */
+} lp_replay_t;
+
+/* Pending outbound records for one tunnel destination. */
+typedef struct {
+    int fd;
+    struct sockaddr_storage dst;
+    socklen_t dst_len;
+    unsigned char raw[LP_TUNNEL_MTU_MAX];
+    size_t raw_len;
+    uint64_t first_ns;
+} lp_batch_t;
+
+/* One listen socket + upstream pair. Link 0 is the default target; the rest mirror rt.routes. */
+typedef struct {
     uint16_t local_port;
     char remote_host[LP_MAX_HOST + 1];
     uint16_t remote_port;
+    struct sockaddr_storage remote_addr;
+    socklen_t remote_addr_len;
+    int local_fd;
+    int remote_fd;
+    uint64_t last_active_ns; /* last client datagram; gates tunnel OPEN announcements */
     struct sockaddr_storage client_addr;
     socklen_t client_addr_len;
     int has_client;
+} lp_link_t;
+
+struct lp_relay_s {
+    lp_app_t *app;
+    pthread_t thread;
+    volatile int stop_flag;
+    int wake_pipe[2];
+    lp_link_t links[LP_MAX_ROUTES + 1];
+    size_t link_count;
+    unsigned routes_gen;
+    int tunnel_fd;
+    uint64_t next_open_ns;
+    lp_codec_t *codec;
+    lp_replay_t tunnel_rx;
+    lp_batch_t batch;
 };
 
+typedef struct {
+    int in_use;
+    struct sockaddr_storage peer;
+    socklen_t peer_len;
+    uint16_t channel;
+    char host[LP_MAX_HOST + 1];
+    uint16_t port;
+    int remote_fd;
+    time_t last_seen;
+    time_t retry_at;  /* remote_fd < 0: when the next OPEN may try to connect again */
+    int retry_secs;
+    lp_batch_t batch;
+} lp_tunnel_session_t;
+
+/* Replay state per client address: clients sharing tunnelKey each count their own packets. */
+typedef struct {
+    int in_use;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    lp_replay_t rx;
+    time_t last_seen;
+} lp_tunnel_peer_t;
+
+typedef struct {
+    lp_app_t *app;
+    pthread_t thread;
+    int fd;
+    int dict_mismatch_logged;
+    lp_codec_t codec;
+    lp_tunnel_session_t sessions[LP_TUNNEL_MAX_SESSIONS];
+    lp_tunnel_peer_t peers[LP_TUNNEL_MAX_SESSIONS];
+} lp_tunnel_server_t;
+
 typedef struct {
     char method[8];
     char path[128];
@@ -93,6 +316,104 @@ static void lp_log(const char *fmt, ...) {
     va_end(ap);
 }
 
+static uint64_t lp_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+typedef enum {
+    LP_TP_RECV = 0,
+    LP_TP_CLASSIFY,
+    LP_TP_FORWARD,
+    LP_TP_DROP,
+    LP_TP_STATE,
+    LP_TP_HTTP,
+    LP_TP_TUNNEL_FLUSH,
+    LP_TP_COUNT
+} lp_tracepoint_t;
+
+#if LP_TRACE
+typedef struct {
+    uint64_t ts_ns;
+    uint32_t arg;
+    uint16_t id;
+    char ph;
+} lp_trace_event_t;
+
+/* One ring per thread role; written only by its owner, read racily by /debug/trace. */
+typedef struct {
+    char name[16];
+    uint32_t tid;
+    int in_use;
+    atomic_uint head;
+    lp_trace_event_t ev[LP_TRACE_RING];
+} lp_trace_ring_t;
+
+static pthread_mutex_t lp_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static lp_trace_ring_t *lp_trace_rings[LP_TRACE_MAX_THREADS];
+static size_t lp_trace_ring_count;
+static uint64_t lp_trace_epoch_ns;
+static _Thread_local lp_trace_ring_t *lp_trace_tls;
+
+static const char *const lp_tracepoint_names[LP_TP_COUNT] = {
+    "recv", "classify", "forward", "drop", "state", "http", "tunnel_flush"
+};
+
+/* Binds the calling thread to the ring of its role, reusing the ring a previous thread left behind. */
+static void lp_trace_attach(const char *name) {
+    lp_trace_ring_t *ring = NULL;
+    pthread_mutex_lock(&lp_trace_lock);
+    if (!lp_trace_epoch_ns) lp_trace_epoch_ns = lp_now_ns();
+    for (size_t i = 0; i < lp_trace_ring_count; i++) {
+        if (!lp_trace_rings[i]->in_use && strcmp(lp_trace_rings[i]->name, name) == 0) {
+            ring = lp_trace_rings[i];
+            break;
+        }
+    }
+    if (!ring && lp_trace_ring_count < LP_TRACE_MAX_THREADS) {
+        ring = (lp_trace_ring_t *)calloc(1, sizeof(*ring));
+        if (ring) {
+            snprintf(ring->name, sizeof(ring->name), "%s", name);
+            ring->tid = (uint32_t)lp_trace_ring_count + 1;
+            lp_trace_rings[lp_trace_ring_count++] = ring;
+        }
+    }
+    if (ring) ring->in_use = 1;
+    lp_trace_tls = ring;
+    pthread_mutex_unlock(&lp_trace_lock);
+}
+
+static void lp_trace_detach(void) {
+    pthread_mutex_lock(&lp_trace_lock);
+    if (lp_trace_tls) lp_trace_tls->in_use = 0;
+    lp_trace_tls = NULL;
+    pthread_mutex_unlock(&lp_trace_lock);
+}
+
+static void lp_trace_emit(lp_tracepoint_t id, char ph, uint32_t arg) {
+    lp_trace_ring_t *ring = lp_trace_tls;
+    lp_trace_event_t *e;
+    unsigned h;
+    if (!ring) return;
+    h = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    e = &ring->ev[h & (LP_TRACE_RING - 1)];
+    e->ts_ns = lp_now_ns();
+    e->arg = arg;
+    e->id = (uint16_t)id;
+    e->ph = ph;
+    atomic_store_explicit(&ring->head, h + 1, memory_order_release);
+}
+
+#define LP_TP(id, ph, arg) lp_trace_emit((id), (ph), (uint32_t)(arg))
+#define LP_TP_ATTACH(name) lp_trace_attach(name)
+#define LP_TP_DETACH() lp_trace_detach()
+#else
+#define LP_TP(id, ph, arg) ((void)0)
+#define LP_TP_ATTACH(name) ((void)0)
+#define LP_TP_DETACH() ((void)0)
+#endif
+
 static void lp_touch_locked(lp_runtime_t *rt) {
     rt->updated_at = time(NULL);
 }
@@ -106,6 +427,7 @@ static void lp_set_message_locked(lp_runtime_t *rt, const char *fmt, ...) {
 }
 
 static void lp_set_state_locked(lp_runtime_t *rt, lp_state_t st) {
+    LP_TP(LP_TP_STATE, 'i', st);
     rt->state = st;
     lp_touch_locked(rt);
 }
@@ -164,7 +486,42 @@ static int lp_json_get_int(const char *json, const char *key, long *out) {
     return 1;
 }
 
-static int lp_read_file(const char *path, char **out) {
+static int lp_json_get_bool(const char *json, const char *key, int *out) {
+    const char *p = lp_find_json_key(json, key);
+    if (!p) return 0;
+    if (strncmp(p, "true", 4) == 0) *out = 1;
+    else if (strncmp(p, "false", 5) == 0) *out = 0;
+    else return 0;
+    return 1;
+}
+
+/* Copies the next {...} object of an array into out and returns the position after it. */
+static const char *lp_json_next_object(const char *p, char *out, size_t out_sz) {
+    const char *start;
+    size_t len;
+    int in_str = 0;
+    p = lp_skip_ws(p);
+    while (*p == ',') p = lp_skip_ws(p + 1);
+    if (*p != '{') return NULL;
+    for (start = p; *p; p++) {
+        if (in_str) {
+            if (*p == '\\' && p[1] != '\0') p++;
+            else if (*p == '"') in_str = 0;
+        } else if (*p == '"') {
+            in_str = 1;
+        } else if (*p == '}') {
+            break;
+        }
+    }
+    if (*p != '}') return NULL;
+    len = (size_t)(p + 1 - start);
+    if (len >= out_sz) return NULL;
+    memcpy(out, start, len);
+    out[len] = '\0';
+    return p + 1;
+}
+
+static int lp_read_file(const char *path, char **out, size_t *out_len) {
     FILE *f = fopen(path, "rb");
     long sz;
     char *buf;
@@ -178,6 +535,83 @@ static int lp_read_file(const char *path, char **out) {
     if (sz > 0 && fread(buf, 1, (size_t)sz, f) != (size_t)sz) { free(buf); fclose(f); return -1; }
     fclose(f);
     *out = buf;
+    if (out_len) *out_len = (size_t)sz;
+    return 0;
+}
+
+static int lp_route_parse(const char *obj, lp_route_t *out) {
+    struct in_addr addr;
+    long v;
+    memset(out, 0, sizeof(*out));
+    if (!lp_json_get_int(obj, "listenPort", &v) || v <= 0 || v > 65535) return -1;
+    out->listen_port = (uint16_t)v;
+    if (!lp_json_get_string(obj, "serverHost", out->server_host, sizeof(out->server_host)) || !out->server_host[0]) return -1;
+    out->server_port = 19132;
+    if (lp_json_get_int(obj, "serverPort", &v)) {
+        if (v <= 0 || v > 65535) return -1;
+        out->server_port = (uint16_t)v;
+    }
+    out->match_port = out->server_port;
+    if (lp_json_get_int(obj, "matchPort", &v)) {
+        if (v <= 0 || v > 65535) return -1;
+        out->match_port = (uint16_t)v;
+    }
+    /* The tweak keys redirects on the original IPv4 destination; default it to the upstream itself.
+     * A hostname upstream needs an explicit matchHost, otherwise the route would act as a port wildcard. */
+    if (lp_json_get_string(obj, "matchHost", out->match_host, sizeof(out->match_host))) {
+        if (strcmp(out->match_host, "*") == 0) {
+            out->match_host[0] = '\0';
+            return 0;
+        }
+        if (inet_pton(AF_INET, out->match_host, &addr) != 1) return -1;
+    } else if (inet_pton(AF_INET, out->server_host, &addr) != 1) {
+        return -1;
+    }
+    /* The tweak keys 0.0.0.0 like "*"; store both as the wildcard so the duplicate check sees one key. */
+    if (addr.s_addr == htonl(INADDR_ANY)) {
+        out->match_host[0] = '\0';
+        return 0;
+    }
+    inet_ntop(AF_INET, &addr, out->match_host, sizeof(out->match_host));
+    return 0;
+}
+
+static size_t lp_route_lower_bound(const lp_route_table_t *t, uint16_t listen_port) {
+    size_t lo = 0, hi = t->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (t->entries[mid].listen_port < listen_port) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/* Returns -1 when the table is full, -2 when another listen port already owns the match key. */
+static int lp_route_upsert(lp_route_table_t *t, const lp_route_t *route) {
+    size_t i = lp_route_lower_bound(t, route->listen_port);
+    for (size_t j = 0; j < t->count; j++) {
+        const lp_route_t *e = &t->entries[j];
+        if (e->listen_port != route->listen_port && e->match_port == route->match_port &&
+            strcmp(e->match_host, route->match_host) == 0) {
+            return -2;
+        }
+    }
+    if (i < t->count && t->entries[i].listen_port == route->listen_port) {
+        t->entries[i] = *route;
+        return 0;
+    }
+    if (t->count >= LP_MAX_ROUTES) return -1;
+    memmove(&t->entries[i + 1], &t->entries[i], (t->count - i) * sizeof(t->entries[0]));
+    t->entries[i] = *route;
+    t->count++;
+    return 0;
+}
+
+static int lp_route_remove(lp_route_table_t *t, uint16_t listen_port) {
+    size_t i = lp_route_lower_bound(t, listen_port);
+    if (i >= t->count || t->entries[i].listen_port != listen_port) return -1;
+    memmove(&t->entries[i], &t->entries[i + 1], (t->count - i - 1) * sizeof(t->entries[0]));
+    t->count--;
     return 0;
 }
 
@@ -189,12 +623,121 @@ static void lp_config_defaults(lp_config_t *cfg) {
     strcpy(cfg->control_auth_token, "change-me");
     cfg->local_proxy_port = 19132;
     cfg->remote_default_port = 19132;
+    strcpy(cfg->routes_path, "/var/mobile/Library/Preferences/com.project.lumina.proxyd.routes.json");
+    strcpy(cfg->tunnel_bind_host, "127.0.0.1");
+    cfg->tunnel_mtu = 1400;
+    cfg->tunnel_batch_us = 500;
+    cfg->tunnel_compress = 1;
+    strcpy(cfg->snapshot_path, "/var/mobile/Library/Preferences/com.project.lumina.proxyd.state");
+    cfg->memory_limit_mb = 32;
+}
+
+static uint32_t lp_fnv1a_step(uint32_t h, const void *p, size_t n) {
+    const unsigned char *b = (const unsigned char *)p;
+    for (size_t i = 0; i < n; i++) {
+        h ^= b[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static uint32_t lp_fnv1a(const unsigned char *p, size_t n) {
+    return lp_fnv1a_step(2166136261u, p, n);
+}
+
+static int lp_hex_decode(const char *hex, unsigned char *out, size_t out_len) {
+    if (strlen(hex) != out_len * 2) return -1;
+    for (size_t i = 0; i < out_len; i++) {
+        unsigned v = 0;
+        for (size_t j = 0; j < 2; j++) {
+            char ch = hex[i * 2 + j];
+            v <<= 4;
+            if (ch >= '0' && ch <= '9') v |= (unsigned)(ch - '0');
+            else if (ch >= 'a' && ch <= 'f') v |= (unsigned)(ch - 'a' + 10);
+            else if (ch >= 'A' && ch <= 'F') v |= (unsigned)(ch - 'A' + 10);
+            else return -1;
+        }
+        out[i] = (unsigned char)v;
+    }
+    return 0;
+}
+
+static void lp_config_load_tunnel(const char *json, lp_config_t *cfg) {
+    char mode[16] = {0};
+    char key[LP_TUNNEL_KEY * 2 + 2] = {0};
+    char dict_path[LP_PATH_BUF] = {0};
+    char *dict = NULL;
+    long v;
+
+    if (!lp_json_get_string(json, "tunnelMode", mode, sizeof(mode)) || strcmp(mode, "off") == 0) return;
+    lp_json_get_string(json, "tunnelPeerHost", cfg->tunnel_peer_host, sizeof(cfg->tunnel_peer_host));
+    lp_json_get_string(json, "tunnelBindHost", cfg->tunnel_bind_host, sizeof(cfg->tunnel_bind_host));
+    if (lp_json_get_int(json, "tunnelPeerPort", &v) && v > 0 && v <= 65535) cfg->tunnel_peer_port = (uint16_t)v;
+    if (lp_json_get_int(json, "tunnelListenPort", &v) && v > 0 && v <= 65535) cfg->tunnel_listen_port = (uint16_t)v;
+    if (lp_json_get_int(json, "tunnelBatchMicros", &v) && v >= 0 && v < 1000000) cfg->tunnel_batch_us = v;
+    if (lp_json_get_int(json, "tunnelMtu", &v) && v >= LP_TUNNEL_MTU_MIN && v <= LP_TUNNEL_MTU_MAX) cfg->tunnel_mtu = v;
+    lp_json_get_bool(json, "tunnelCompress", &cfg->tunnel_compress);
+
+    /* Every tunnel packet is authenticated; without a key the server would be an open relay. */
+    if (!lp_json_get_string(json, "tunnelKey", key, sizeof(key)) ||
+        lp_hex_decode(key, cfg->tunnel_key, sizeof(cfg->tunnel_key)) != 0) {
+        lp_log("ignoring tunnelMode=%s (tunnelKey must be %d hex characters)", mode, LP_TUNNEL_KEY * 2);
+        return;
+    }
+    if (strcmp(mode, "client") == 0 && cfg->tunnel_peer_host[0] && cfg->tunnel_peer_port) {
+        cfg->tunnel_mode = LP_TUNNEL_CLIENT;
+    } else if (strcmp(mode, "server") == 0 && cfg->tunnel_listen_port) {
+        cfg->tunnel_mode = LP_TUNNEL_SERVER;
+    } else {
+        lp_log("ignoring tunnelMode=%s (missing tunnelPeerHost/tunnelPeerPort or tunnelListenPort)", mode);
+        return;
+    }
+
+    /* Both peers must load the same dictionary; only its tail fits the LZ window. */
+    if (lp_json_get_string(json, "tunnelDictPath", dict_path, sizeof(dict_path)) && dict_path[0]) {
+        size_t len = 0;
+        if (lp_read_file(dict_path, &dict, &len) != 0) {
+            lp_log("failed to load tunnel dictionary: %s", dict_path);
+            return;
+        }
+        if (len > LP_TUNNEL_DICT_MAX) {
+            memmove(dict, dict + (len - LP_TUNNEL_DICT_MAX), LP_TUNNEL_DICT_MAX);
+            len = LP_TUNNEL_DICT_MAX;
+        }
+        cfg->tunnel_dict = (unsigned char *)dict;
+        cfg->tunnel_dict_len = len;
+        cfg->tunnel_dict_id = lp_fnv1a(cfg->tunnel_dict, len);
+    }
+}
+
+static void lp_config_load_routes(const char *json, lp_config_t *cfg) {
+    const char *p = lp_find_json_key(json, "routes");
+    char obj[1024];
+    lp_route_t route;
+    int rc;
+    if (!p || *p != '[') return;
+    p++;
+    while ((p = lp_json_next_object(p, obj, sizeof(obj))) != NULL) {
+        if (lp_route_parse(obj, &route) != 0 || route.listen_port == cfg->local_proxy_port) {
+            lp_log("ignoring invalid route: %s", obj);
+            continue;
+        }
+        rc = lp_route_upsert(&cfg->routes, &route);
+        if (rc == -2) {
+            lp_log("ignoring route with duplicate matchHost/matchPort: %s", obj);
+            continue;
+        }
+        if (rc != 0) {
+            lp_log("route table full (max %d), ignoring remaining routes", LP_MAX_ROUTES);
+            break;
+        }
+    }
 }
 
 static int lp_config_load(const char *path, lp_config_t *cfg) {
     char *json = NULL;
     long v;
-    if (lp_read_file(path, &json) != 0) return -1;
+    if (lp_read_file(path, &json, NULL) != 0) return -1;
     lp_config_defaults(cfg);
     lp_json_get_string(json, "deviceId", cfg->device_id, sizeof(cfg->device_id));
     lp_json_get_string(json, "controlBindHost", cfg->control_bind_host, sizeof(cfg->control_bind_host));
@@ -203,6 +746,11 @@ static int lp_config_load(const char *path, lp_config_t *cfg) {
     if (lp_json_get_int(json, "controlPort", &v) && v > 0 && v <= 65535) cfg->control_port = (uint16_t)v;
     if (lp_json_get_int(json, "localProxyPort", &v) && v > 0 && v <= 65535) cfg->local_proxy_port = (uint16_t)v;
     if (lp_json_get_int(json, "remoteDefaultPort", &v) && v > 0 && v <= 65535) cfg->remote_default_port = (uint16_t)v;
+    lp_json_get_string(json, "routesPath", cfg->routes_path, sizeof(cfg->routes_path));
+    lp_json_get_string(json, "snapshotPath", cfg->snapshot_path, sizeof(cfg->snapshot_path));
+    if (lp_json_get_int(json, "memoryLimitMB", &v) && v >= 0) cfg->memory_limit_mb = v;
+    lp_config_load_routes(json, cfg);
+    lp_config_load_tunnel(json, cfg);
     free(json);
     return 0;
 }
@@ -210,16 +758,21 @@ static int lp_config_load(const char *path, lp_config_t *cfg) {
 static void lp_runtime_init(lp_runtime_t *rt, const lp_config_t *cfg) {
     memset(rt, 0, sizeof(*rt));
     pthread_mutex_init(&rt->lock, NULL);
+    pthread_mutex_init(&rt->ctl_lock, NULL);
+    pthread_cond_init(&rt->upkeep_cond, NULL);
     rt->state = LP_STOPPED;
     rt->updated_at = time(NULL);
     if (cfg->remote_default_host[0]) {
         strncpy(rt->target_host, cfg->remote_default_host, sizeof(rt->target_host) - 1);
         rt->target_port = cfg->remote_default_port;
     }
+    rt->routes = cfg->routes;
     strcpy(rt->message, "Idle");
 }
 
 static void lp_runtime_destroy(lp_runtime_t *rt) {
+    pthread_cond_destroy(&rt->upkeep_cond);
+    pthread_mutex_destroy(&rt->ctl_lock);
     pthread_mutex_destroy(&rt->lock);
 }
 
@@ -258,6 +811,30 @@ static int lp_udp_bind_loopback(uint16_t port) {
     return fd;
 }
 
+static int lp_udp_resolve(const char *host, uint16_t port, struct sockaddr_storage *out, socklen_t *out_len) {
+    struct addrinfo hints, *res = NULL;
+    char port_str[16];
+    snprintf(port_str, sizeof(port_str), "%u", (unsigned)port);
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_family = AF_UNSPEC;
+    if (getaddrinfo(host, port_str, &hints, &res) != 0 || !res) return -1;
+    memcpy(out, res->ai_addr, res->ai_addrlen);
+    *out_len = (socklen_t)res->ai_addrlen;
+    freeaddrinfo(res);
+    return 0;
+}
+
+static int lp_udp_connect_addr(const struct sockaddr_storage *addr, socklen_t addr_len) {
+    int fd = socket(addr->ss_family, SOCK_DGRAM, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (const struct sockaddr *)addr, addr_len) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
 static int lp_udp_connect_remote(const char *host, uint16_t port) {
     struct addrinfo hints, *res = NULL, *it;
     char port_str[16];
@@ -278,142 +855,999 @@ static int lp_udp_connect_remote(const char *host, uint16_t port) {
     return fd;
 }
 
+/* Worker threads get a small fixed stack; their largest frame is one UDP buffer. */
+static int lp_thread_create(pthread_t *thread, void *(*fn)(void *), void *arg) {
+    pthread_attr_t attr;
+    int rc;
+    if (pthread_attr_init(&attr) != 0) return -1;
+    (void)pthread_attr_setstacksize(&attr, LP_THREAD_STACK);
+    rc = pthread_create(thread, &attr, fn, arg);
+    pthread_attr_destroy(&attr);
+    return rc;
+}
+
+/* Names show up in /proc/<pid>/task/<tid>/comm, where `replay --relay-pid` attributes CPU time. */
+static void lp_thread_name(const char *name) {
+#ifdef __linux__
+    (void)prctl(PR_SET_NAME, name, 0, 0, 0);
+#else
+    (void)name;
+#endif
+}
+
 static void lp_drain_pipe(int fd) {
     char buf[64];
     while (read(fd, buf, sizeof(buf)) > 0) {}
 }
 
+static void lp_put_be16(unsigned char *p, uint16_t v) {
+    p[0] = (unsigned char)(v >> 8);
+    p[1] = (unsigned char)v;
+}
+
+static uint16_t lp_get_be16(const unsigned char *p) {
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static void lp_put_be32(unsigned char *p, uint32_t v) {
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+static uint32_t lp_get_be32(const unsigned char *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void lp_put_be64(unsigned char *p, uint64_t v) {
+    for (int i = 7; i >= 0; i--, v >>= 8) p[i] = (unsigned char)v;
+}
+
+static uint64_t lp_get_be64(const unsigned char *p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++) v = (v << 8) | p[i];
+    return v;
+}
+
+static uint64_t lp_get_le64(const unsigned char *p) {
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--) v = (v << 8) | p[i];
+    return v;
+}
+
+static uint64_t lp_wall_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000ULL;
+}
+
+#define LP_ROTL64(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+static void lp_sipround(uint64_t v[4]) {
+    v[0] += v[1]; v[1] = LP_ROTL64(v[1], 13); v[1] ^= v[0]; v[0] = LP_ROTL64(v[0], 32);
+    v[2] += v[3]; v[3] = LP_ROTL64(v[3], 16); v[3] ^= v[2];
+    v[0] += v[3]; v[3] = LP_ROTL64(v[3], 21); v[3] ^= v[0];
+    v[2] += v[1]; v[1] = LP_ROTL64(v[1], 17); v[1] ^= v[2]; v[2] = LP_ROTL64(v[2], 32);
+}
+
+/* SipHash-2-4: a short-input MAC, cheap enough to run on every tunnel packet. */
+static uint64_t lp_siphash(const unsigned char key[LP_TUNNEL_KEY], const unsigned char *in, size_t n) {
+    uint64_t k0 = lp_get_le64(key), k1 = lp_get_le64(key + 8);
+    uint64_t v[4] = {0x736f6d6570736575ULL ^ k0, 0x646f72616e646f6dULL ^ k1,
+                     0x6c7967656e657261ULL ^ k0, 0x7465646279746573ULL ^ k1};
+    uint64_t b = (uint64_t)n << 56;
+    const unsigned char *end = in + (n & ~(size_t)7);
+    for (; in != end; in += 8) {
+        uint64_t m = lp_get_le64(in);
+        v[3] ^= m;
+        lp_sipround(v);
+        lp_sipround(v);
+        v[0] ^= m;
+    }
+    for (size_t i = 0; i < (n & 7); i++) b |= (uint64_t)in[i] << (8 * i);
+    v[3] ^= b;
+    lp_sipround(v);
+    lp_sipround(v);
+    v[0] ^= b;
+    v[2] ^= 0xff;
+    for (int i = 0; i < 4; i++) lp_sipround(v);
+    return v[0] ^ v[1] ^ v[2] ^ v[3];
+}
+
+static uint32_t lp_lz_hash(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761u) >> (32 - LP_LZ_HASH_BITS);
+}
+
+static int lp_codec_init(lp_codec_t *c, lp_app_t *app) {
+    memset(c->dict_hash, 0, sizeof(c->dict_hash));
+    c->app = app;
+    c->compress = app->cfg.tunnel_compress;
+    c->dict_len = app->cfg.tunnel_dict_len;
+    /* Counting up from the start-up time keeps counters increasing across restarts of this peer. */
+    c->tx_seq = lp_wall_us();
+    c->win = (unsigned char *)malloc(c->dict_len + LP_UDP_BUF);
+    if (!c->win) return -1;
+    if (c->dict_len) memcpy(c->win, app->cfg.tunnel_dict, c->dict_len);
+    for (size_t i = 0; i + LP_LZ_MINMATCH <= c->dict_len; i++) {
+        c->dict_hash[lp_lz_hash(c->win + i)] = (uint32_t)i + 1;
+    }
+    return 0;
+}
+
+static void lp_codec_free(lp_codec_t *c) {
+    if (!c) return;
+    free(c->win);
+    free(c);
+}
+
+static int lp_lz_put_len(unsigned char **op, const unsigned char *oend, size_t len) {
+    while (len >= 255) {
+        if (*op >= oend) return 0;
+        *(*op)++ = 255;
+        len -= 255;
+    }
+    if (*op >= oend) return 0;
+    *(*op)++ = (unsigned char)len;
+    return 1;
+}
+
+/* Emits one LZ4-style sequence; mlen == 0 marks the trailing literal run. */
+static int lp_lz_emit(unsigned char **op, const unsigned char *oend,
+                      const unsigned char *lit, size_t lit_len, size_t offset, size_t mlen) {
+    size_t ml = mlen ? mlen - LP_LZ_MINMATCH : 0;
+    unsigned char *token;
+    if (*op >= oend) return 0;
+    token = (*op)++;
+    *token = (unsigned char)(((lit_len >= 15 ? 15 : lit_len) << 4) | (ml >= 15 ? 15 : ml));
+    if (lit_len >= 15 && !lp_lz_put_len(op, oend, lit_len - 15)) return 0;
+    if ((size_t)(oend - *op) < lit_len) return 0;
+    memcpy(*op, lit, lit_len);
+    *op += lit_len;
+    if (!mlen) return 1;
+    if (oend - *op < 2) return 0;
+    (*op)[0] = (unsigned char)offset;
+    (*op)[1] = (unsigned char)(offset >> 8);
+    *op += 2;
+    return ml < 15 || lp_lz_put_len(op, oend, ml - 15);
+}
+
+/* Greedy single-probe LZ over dict||src. Returns 0 when the output would not be smaller. */
+static size_t lp_lz_compress(lp_codec_t *c, const unsigned char *src, size_t n,
+                             unsigned char *dst, size_t cap) {
+    unsigned char *base = c->win;
+    unsigned char *op = dst;
+    const unsigned char *oend = dst + cap;
+    size_t start = c->dict_len, end = start + n, ip = start, anchor = start;
+
+    memcpy(base + start, src, n);
+    memcpy(c->hash, c->dict_hash, sizeof(c->hash));
+    if (n > LP_LZ_MFLIMIT) {
+        size_t limit = end - LP_LZ_MFLIMIT;
+        while (ip < limit) {
+            uint32_t h = lp_lz_hash(base + ip);
+            size_t ref = c->hash[h];
+            size_t mlen = LP_LZ_MINMATCH, mmax;
+            c->hash[h] = (uint32_t)ip + 1;
+            if (ref == 0 || ip - (ref - 1) > LP_LZ_MAX_OFFSET || memcmp(base + ref - 1, base + ip, LP_LZ_MINMATCH) != 0) {
+                ip++;
+                continue;
+            }
+            ref--;
+            mmax = end - LP_LZ_LASTLITERALS - ip;
+            while (mlen < mmax && base[ref + mlen] == base[ip + mlen]) mlen++;
+            if (!lp_lz_emit(&op, oend, base + anchor, ip - anchor, ip - ref, mlen)) return 0;
+            ip += mlen;
+            anchor = ip;
+        }
+    }
+    if (!lp_lz_emit(&op, oend, base + anchor, end - anchor, 0, 0)) return 0;
+    return (size_t)(op - dst);
+}
+
+static int lp_lz_read_len(const unsigned char **ip, const unsigned char *iend, size_t *len) {
+    unsigned char b;
+    do {
+        if (*ip >= iend) return 0;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 1;
+}
+
+static const unsigned char *lp_lz_decompress(lp_codec_t *c, const unsigned char *src, size_t n, size_t raw_len) {
+    unsigned char *base = c->win;
+    unsigned char *op = base + c->dict_len;
+    const unsigned char *oend = op + raw_len;
+    const unsigned char *ip = src, *iend = src + n;
+
+    while (ip < iend) {
+        unsigned token = *ip++;
+        size_t len = token >> 4, off;
+        if (len == 15 && !lp_lz_read_len(&ip, iend, &len)) return NULL;
+        if ((size_t)(iend - ip) < len || (size_t)(oend - op) < len) return NULL;
+        memcpy(op, ip, len);
+        op += len;
+        ip += len;
+        if (ip >= iend) break;
+        if (iend - ip < 2) return NULL;
+        off = (size_t)ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        if (off == 0 || off > (size_t)(op - base)) return NULL;
+        len = token & 15;
+        if (len == 15 && !lp_lz_read_len(&ip, iend, &len)) return NULL;
+        len += LP_LZ_MINMATCH;
+        if ((size_t)(oend - op) < len) return NULL;
+        for (const unsigned char *ref = op - off; len; len--) *op++ = *ref++;
+    }
+    return op == oend ? base + c->dict_len : NULL;
+}
+
+/* Frames raw records into c->pkt (compressing when it pays off) and sends them. */
+static void lp_tunnel_send(lp_codec_t *c, int fd, const struct sockaddr *dst, socklen_t dst_len,
+                           const unsigned char *raw, size_t raw_len) {
+    size_t body = 0;
+    unsigned char flags = 0;
+    if (c->compress && raw_len > LP_LZ_MFLIMIT) {
+        body = lp_lz_compress(c, raw, raw_len, c->pkt + LP_TUNNEL_HDR, raw_len - 1);
+        if (body) flags |= LP_TUNNEL_F_COMPRESSED;
+    }
+    if (!body) {
+        memcpy(c->pkt + LP_TUNNEL_HDR, raw, raw_len);
+        body = raw_len;
+    }
+    c->pkt[0] = LP_TUNNEL_MAGIC;
+    c->pkt[1] = (unsigned char)((LP_TUNNEL_VERSION << 4) | flags);
+    lp_put_be16(c->pkt + 2, (uint16_t)raw_len);
+    lp_put_be32(c->pkt + 4, (uint32_t)(lp_wall_us() / 1000000ULL));
+    lp_put_be64(c->pkt + 8, ++c->tx_seq);
+    body += LP_TUNNEL_HDR;
+    lp_put_be64(c->pkt + body, lp_siphash(c->app->cfg.tunnel_key, c->pkt, body));
+    body += LP_TUNNEL_TAG;
+    LP_TP(LP_TP_TUNNEL_FLUSH, 'i', raw_len);
+    if (sendto(fd, c->pkt, body, 0, dst, dst_len) < 0) {
+        LP_TP(LP_TP_DROP, 'i', raw_len);
+        atomic_fetch_add_explicit(&c->app->tunnel.drops, 1, memory_order_relaxed);
+        return;
+    }
+    atomic_fetch_add_explicit(&c->app->tunnel.raw_bytes, raw_len, memory_order_relaxed);
+    atomic_fetch_add_explicit(&c->app->tunnel.wire_bytes, body, memory_order_relaxed);
+    atomic_fetch_add_explicit(&c->app->tunnel.packets, 1, memory_order_relaxed);
+}
+
+/* Clock-skew check plus a sliding 64-packet anti-replay window over the sender's packet
+ * counter; only called for packets whose tag already verified. */
+static int lp_tunnel_replay_ok(lp_replay_t *rx, uint32_t sent_secs, uint64_t seq) {
+    int64_t skew = (int64_t)(lp_wall_us() / 1000000ULL) - (int64_t)sent_secs;
+    uint64_t diff;
+    if (skew > LP_TUNNEL_MAX_SKEW_SECS || skew < -LP_TUNNEL_MAX_SKEW_SECS) return 0;
+    if (seq > rx->top) {
+        diff = seq - rx->top;
+        rx->window = diff >= 64 ? 1 : (rx->window << diff) | 1;
+        rx->top = seq;
+        return 1;
+    }
+    diff = rx->top - seq;
+    if (diff >= 64 || (rx->window & (1ULL << diff))) return 0;
+    rx->window |= 1ULL << diff;
+    return 1;
+}
+
+/* Returns the raw record block of a received tunnel packet, or NULL if it is malformed,
+ * unauthenticated or replayed according to the sender's state in rx. Nothing in the
+ * packet is trusted before the tag checks out. */
+static const unsigned char *lp_tunnel_open(lp_codec_t *c, lp_replay_t *rx, const unsigned char *pkt, size_t n,
+                                           size_t *raw_len) {
+    if (n < LP_TUNNEL_HDR + LP_TUNNEL_TAG || pkt[0] != LP_TUNNEL_MAGIC || (pkt[1] >> 4) != LP_TUNNEL_VERSION) return NULL;
+    n -= LP_TUNNEL_TAG;
+    if (lp_siphash(c->app->cfg.tunnel_key, pkt, n) != lp_get_be64(pkt + n) ||
+        !lp_tunnel_replay_ok(rx, lp_get_be32(pkt + 4), lp_get_be64(pkt + 8))) {
+        atomic_fetch_add_explicit(&c->app->tunnel.auth_failures, 1, memory_order_relaxed);
+        return NULL;
+    }
+    *raw_len = lp_get_be16(pkt + 2);
+    if (!(pkt[1] & LP_TUNNEL_F_COMPRESSED)) {
+        return (n - LP_TUNNEL_HDR == *raw_len) ? pkt + LP_TUNNEL_HDR : NULL;
+    }
+    return lp_lz_decompress(c, pkt + LP_TUNNEL_HDR, n - LP_TUNNEL_HDR, *raw_len);
+}
+
+static const unsigned char *lp_tunnel_next_record(const unsigned char *p, const unsigned char *end,
+                                                  unsigned *type, uint16_t *channel,
+                                                  const unsigned char **data, size_t *len) {
+    if (end - p < LP_TUNNEL_REC_HDR) return NULL;
+    *type = p[0];
+    *channel = lp_get_be16(p + 1);
+    *len = lp_get_be16(p + 3);
+    if ((size_t)(end - p - LP_TUNNEL_REC_HDR) < *len) return NULL;
+    *data = p + LP_TUNNEL_REC_HDR;
+    return *data + *len;
+}
+
+static void lp_batch_init(lp_batch_t *b, int fd, const struct sockaddr *dst, socklen_t dst_len) {
+    b->fd = fd;
+    b->raw_len = 0;
+    b->dst_len = dst_len;
+    if (dst && dst_len) memcpy(&b->dst, dst, dst_len);
+}
+
+static void lp_batch_flush(lp_codec_t *c, lp_batch_t *b) {
+    if (!b->raw_len) return;
+    lp_tunnel_send(c, b->fd, b->dst_len ? (struct sockaddr *)&b->dst : NULL, b->dst_len, b->raw, b->raw_len);
+    b->raw_len = 0;
+}
+
+/* Queues one record, flushing first if it would overflow the batch. A datagram that cannot fit one
+ * tunnelMtu-sized packet is dropped rather than fragmented, which clamps RakNet's MTU discovery. */
+static void lp_batch_add(lp_codec_t *c, lp_batch_t *b, unsigned type, uint16_t channel,
+                         const unsigned char *data, size_t len, uint64_t now) {
+    size_t need = LP_TUNNEL_REC_HDR + len;
+    size_t cap = (size_t)c->app->cfg.tunnel_mtu - LP_TUNNEL_HDR - LP_TUNNEL_TAG;
+    unsigned char hdr[LP_TUNNEL_REC_HDR];
+    hdr[0] = (unsigned char)type;
+    lp_put_be16(hdr + 1, channel);
+    lp_put_be16(hdr + 3, (uint16_t)len);
+
+    if (need > cap) {
+        LP_TP(LP_TP_DROP, 'i', len);
+        atomic_fetch_add_explicit(&c->app->tunnel.drops, 1, memory_order_relaxed);
+        return;
+    }
+    if (b->raw_len + need > cap) lp_batch_flush(c, b);
+    if (!b->raw_len) b->first_ns = now;
+    memcpy(b->raw + b->raw_len, hdr, sizeof(hdr));
+    memcpy(b->raw + b->raw_len + sizeof(hdr), data, len);
+    b->raw_len += need;
+}
+
+/* Flushes when the batching window has elapsed; returns ns until it will, or UINT64_MAX if empty. */
+static uint64_t lp_batch_poll(lp_codec_t *c, lp_batch_t *b, uint64_t now) {
+    uint64_t window = (uint64_t)c->app->cfg.tunnel_batch_us * 1000ULL;
+    if (!b->raw_len) return UINT64_MAX;
+    if (now - b->first_ns >= window) {
+        lp_batch_flush(c, b);
+        return UINT64_MAX;
+    }
+    return window - (now - b->first_ns);
+}
+
+static void lp_tunnel_open_record(lp_codec_t *c, lp_batch_t *b, const lp_link_t *l, uint64_t now) {
+    unsigned char rec[6 + LP_MAX_HOST];
+    size_t host_len = strlen(l->remote_host);
+    lp_put_be32(rec, c->app->cfg.tunnel_dict_id);
+    lp_put_be16(rec + 4, l->remote_port);
+    memcpy(rec + 6, l->remote_host, host_len);
+    lp_batch_add(c, b, LP_TUNNEL_REC_OPEN, l->local_port, rec, 6 + host_len, now);
+}
+
+static void lp_link_init(lp_link_t *l, uint16_t local_port, const char *host, uint16_t port) {
+    memset(l, 0, sizeof(*l));
+    l->local_fd = -1;
+    l->remote_fd = -1;
+    l->local_port = local_port;
+    l->remote_port = port;
+    strncpy(l->remote_host, host, sizeof(l->remote_host) - 1);
+}
+
+static void lp_link_init_route(lp_link_t *l, const lp_route_t *route) {
+    lp_link_init(l, route->listen_port, route->server_host, route->server_port);
+    l->remote_addr = route->server_addr;
+    l->remote_addr_len = route->server_addr_len;
+}
+
+static void lp_link_close(lp_link_t *l) {
+    lp_closefd(&l->local_fd);
+    lp_closefd(&l->remote_fd);
+    l->has_client = 0;
+}
+
+/* The relay never resolves: a route whose address is not known yet stays bound without an
+ * upstream until the upkeep thread resolves it and bumps routes_gen. */
+static int lp_link_connect(lp_app_t *app, lp_link_t *l) {
+    if (app->cfg.tunnel_mode == LP_TUNNEL_CLIENT || l->remote_addr_len == 0) return 0;
+    l->remote_fd = lp_udp_connect_addr(&l->remote_addr, l->remote_addr_len);
+    if (l->remote_fd < 0) {
+        lp_runtime_event(app, "Relay failed: connect %s:%u", l->remote_host, (unsigned)l->remote_port);
+        return -1;
+    }
+    return 0;
+}
+
+static int lp_link_open(lp_app_t *app, lp_link_t *l) {
+    l->local_fd = lp_udp_bind_loopback(l->local_port);
+    if (l->local_fd < 0) {
+        lp_runtime_event(app, "Relay failed: bind 127.0.0.1:%u", (unsigned)l->local_port);
+        return -1;
+    }
+    if (lp_link_connect(app, l) != 0) {
+        lp_closefd(&l->local_fd);
+        return -1;
+    }
+    return 0;
+}
+
+static void lp_link_pump(lp_relay_t *r, lp_link_t *l, fd_set *rfds, unsigned char *buf, size_t buf_sz, uint64_t now) {
+    if (FD_ISSET(l->local_fd, rfds)) {
+        struct sockaddr_storage src;
+        socklen_t src_len = sizeof(src);
+        ssize_t n = recvfrom(l->local_fd, buf, buf_sz, 0, (struct sockaddr *)&src, &src_len);
+        if (n > 0) {
+            LP_TP(LP_TP_RECV, 'i', n);
+            l->client_addr = src;
+            l->client_addr_len = src_len;
+            l->has_client = 1;
+            LP_TP(LP_TP_CLASSIFY, 'i', l->local_port);
+            if (r->codec) {
+                /* Announce on the first datagram after idling; the server may have closed the session. */
+                if (!l->last_active_ns || now - l->last_active_ns > LP_TUNNEL_ACTIVE_NS) {
+                    lp_tunnel_open_record(r->codec, &r->batch, l, now);
+                    if (r->next_open_ns == UINT64_MAX) r->next_open_ns = now + LP_TUNNEL_OPEN_INTERVAL_NS;
+                }
+                l->last_active_ns = now;
+                lp_batch_add(r->codec, &r->batch, LP_TUNNEL_REC_DATA, l->local_port, buf, (size_t)n, now);
+            } else if (l->remote_fd < 0 || send(l->remote_fd, buf, (size_t)n, 0) < 0) {
+                LP_TP(LP_TP_DROP, 'i', n);
+            } else {
+                LP_TP(LP_TP_FORWARD, 'i', n);
+            }
+        }
+    }
+
+    if (l->remote_fd >= 0 && FD_ISSET(l->remote_fd, rfds)) {
+        ssize_t n = recv(l->remote_fd, buf, buf_sz, 0);
+        if (n > 0) {
+            LP_TP(LP_TP_RECV, 'i', n);
+            if (!l->has_client) {
+                LP_TP(LP_TP_DROP, 'i', n);
+            } else if (sendto(l->local_fd, buf, (size_t)n, 0,
+                              (struct sockaddr *)&l->client_addr, l->client_addr_len) < 0) {
+                LP_TP(LP_TP_DROP, 'i', n);
+            } else {
+                LP_TP(LP_TP_FORWARD, 'i', n);
+            }
+        }
+    }
+}
+
+/* Rebuilds links 1..n from rt.routes, keeping sockets (and the bound client) of unchanged routes. */
+static void lp_relay_sync_routes(lp_relay_t *r) {
+    lp_route_table_t tbl;
+    lp_link_t next[LP_MAX_ROUTES + 1];
+    size_t n = 1;
+
+    pthread_mutex_lock(&r->app->rt.lock);
+    tbl = r->app->rt.routes;
+    r->routes_gen = r->app->rt.routes_gen;
+    pthread_mutex_unlock(&r->app->rt.lock);
+
+    next[0] = r->links[0];
+    for (size_t i = 0; i < tbl.count; i++) {
+        const lp_route_t *route = &tbl.entries[i];
+        lp_link_t *l = &next[n++];
+        int reused = 0;
+        for (size_t j = 1; j < r->link_count; j++) {
+            lp_link_t *old = &r->links[j];
+            if (old->local_fd >= 0 &&
+                old->local_port == route->listen_port &&
+                old->remote_port == route->server_port &&
+                strcmp(old->remote_host, route->server_host) == 0) {
+                *l = *old;
+                old->local_fd = -1;
+                old->remote_fd = -1;
+                reused = 1;
+                break;
+            }
+        }
+        if (!reused) {
+            lp_link_init_route(l, route);
+        } else if (route->server_addr_len &&
+                   (l->remote_addr_len != route->server_addr_len ||
+                    memcmp(&l->remote_addr, &route->server_addr, route->server_addr_len) != 0)) {
+            /* Resolved (or re-resolved) since the link opened: swap the upstream, keep the client. */
+            lp_closefd(&l->remote_fd);
+            l->remote_addr = route->server_addr;
+            l->remote_addr_len = route->server_addr_len;
+        }
+    }
+    for (size_t j = 1; j < r->link_count; j++) lp_link_close(&r->links[j]);
+    for (size_t i = 1; i < n; i++) {
+        if (next[i].local_fd < 0) (void)lp_link_open(r->app, &next[i]);
+        else if (next[i].remote_fd < 0) (void)lp_link_connect(r->app, &next[i]);
+    }
+    memcpy(r->links, next, n * sizeof(next[0]));
+    r->link_count = n;
+    r->next_open_ns = 0;
+}
+
+/* Unpacks a batch from the tunnel peer and hands each datagram to the client of its link. */
+static void lp_relay_tunnel_rx(lp_relay_t *r, unsigned char *buf, size_t buf_sz) {
+    const unsigned char *raw, *p, *end, *data;
+    size_t raw_len, len;
+    unsigned type;
+    uint16_t channel;
+    ssize_t n = recv(r->tunnel_fd, buf, buf_sz, 0);
+    if (n <= 0) return;
+    LP_TP(LP_TP_RECV, 'i', n);
+    raw = lp_tunnel_open(r->codec, &r->tunnel_rx, buf, (size_t)n, &raw_len);
+    if (!raw) {
+        LP_TP(LP_TP_DROP, 'i', n);
+        atomic_fetch_add_explicit(&r->app->tunnel.drops, 1, memory_order_relaxed);
+        return;
+    }
+    for (p = raw, end = raw + raw_len; (p = lp_tunnel_next_record(p, end, &type, &channel, &data, &len)) != NULL;) {
+        lp_link_t *dst = NULL;
+        if (type != LP_TUNNEL_REC_DATA) continue;
+        LP_TP(LP_TP_CLASSIFY, 'i', channel);
+        for (size_t i = 0; i < r->link_count; i++) {
+            if (r->links[i].local_port == channel) {
+                dst = &r->links[i];
+                break;
+            }
+        }
+        if (dst && dst->local_fd >= 0 && dst->has_client &&
+            sendto(dst->local_fd, data, len, 0, (struct sockaddr *)&dst->client_addr, dst->client_addr_len) >= 0) {
+            LP_TP(LP_TP_FORWARD, 'i', len);
+        } else {
+            LP_TP(LP_TP_DROP, 'i', len);
+        }
+    }
+}
+
+/* Re-announces recently active link targets so a restarted server picks the sessions back up.
+ * Idle links stay silent; their next datagram announces them again. */
+static void lp_relay_tunnel_open_all(lp_relay_t *r, uint64_t now) {
+    int active = 0;
+    for (size_t i = 0; i < r->link_count; i++) {
+        lp_link_t *l = &r->links[i];
+        if (l->local_fd < 0 || !l->last_active_ns || now - l->last_active_ns > LP_TUNNEL_ACTIVE_NS) continue;
+        lp_tunnel_open_record(r->codec, &r->batch, l, now);
+        active = 1;
+    }
+    r->next_open_ns = active ? now + LP_TUNNEL_OPEN_INTERVAL_NS : UINT64_MAX;
+}
+
 static void *lp_relay_thread(void *arg) {
     lp_relay_t *r = (lp_relay_t *)arg;
+    lp_link_t *def = &r->links[0];
     unsigned char buf[LP_UDP_BUF];
 
-    r->local_fd = lp_udp_bind_loopback(r->local_port);
-    if (r->local_fd < 0) {
-        lp_runtime_event(r->app, "Relay failed: bind 127.0.0.1:%u", (unsigned)r->local_port);
+    lp_thread_name("relay");
+    LP_TP_ATTACH("relay");
+    if (r->app->cfg.tunnel_mode != LP_TUNNEL_CLIENT &&
+        lp_udp_resolve(def->remote_host, def->remote_port, &def->remote_addr, &def->remote_addr_len) != 0) {
+        lp_runtime_event(r->app, "Relay failed: resolve %s:%u", def->remote_host, (unsigned)def->remote_port);
         goto fail;
     }
-    r->remote_fd = lp_udp_connect_remote(r->remote_host, r->remote_port);
-    if (r->remote_fd < 0) {
-        lp_runtime_event(r->app, "Relay failed: connect %s:%u", r->remote_host, (unsigned)r->remote_port);
-        goto fail;
+    if (lp_link_open(r->app, def) != 0) goto fail;
+    if (r->app->cfg.tunnel_mode == LP_TUNNEL_CLIENT) {
+        r->tunnel_fd = lp_udp_connect_remote(r->app->cfg.tunnel_peer_host, r->app->cfg.tunnel_peer_port);
+        r->codec = (lp_codec_t *)calloc(1, sizeof(*r->codec));
+        if (r->tunnel_fd < 0 || !r->codec || lp_codec_init(r->codec, r->app) != 0) {
+            lp_runtime_event(r->app, "Relay failed: tunnel %s:%u",
+                             r->app->cfg.tunnel_peer_host, (unsigned)r->app->cfg.tunnel_peer_port);
+            goto fail;
+        }
+        lp_batch_init(&r->batch, r->tunnel_fd, NULL, 0);
     }
+    lp_relay_sync_routes(r);
 
-    lp_runtime_event(r->app, "Relay ready on 127.0.0.1:%u -> %s:%u",
-                     (unsigned)r->local_port, r->remote_host, (unsigned)r->remote_port);
+    pthread_mutex_lock(&r->app->rt.lock);
+    r->app->rt.relay_failures = 0;
+    pthread_mutex_unlock(&r->app->rt.lock);
+    if (r->codec) {
+        lp_runtime_event(r->app, "Relay ready on 127.0.0.1:%u -> %s:%u (+%zu routes) via tunnel %s:%u",
+                         (unsigned)def->local_port, def->remote_host, (unsigned)def->remote_port,
+                         r->link_count - 1, r->app->cfg.tunnel_peer_host, (unsigned)r->app->cfg.tunnel_peer_port);
+    } else {
+        lp_runtime_event(r->app, "Relay ready on 127.0.0.1:%u -> %s:%u (+%zu routes)",
+                         (unsigned)def->local_port, def->remote_host, (unsigned)def->remote_port,
+                         r->link_count - 1);
+    }
 
     while (!r->stop_flag) {
         fd_set rfds;
         int maxfd = -1;
+        unsigned gen;
+        struct timeval tv, *tvp = NULL;
+        uint64_t now;
         FD_ZERO(&rfds);
         FD_SET(r->wake_pipe[0], &rfds);
         if (r->wake_pipe[0] > maxfd) maxfd = r->wake_pipe[0];
-        FD_SET(r->local_fd, &rfds);
-        if (r->local_fd > maxfd) maxfd = r->local_fd;
-        FD_SET(r->remote_fd, &rfds);
-        if (r->remote_fd > maxfd) maxfd = r->remote_fd;
+        for (size_t i = 0; i < r->link_count; i++) {
+            lp_link_t *l = &r->links[i];
+            if (l->local_fd < 0) continue;
+            FD_SET(l->local_fd, &rfds);
+            if (l->local_fd > maxfd) maxfd = l->local_fd;
+            if (l->remote_fd < 0) continue;
+            FD_SET(l->remote_fd, &rfds);
+            if (l->remote_fd > maxfd) maxfd = l->remote_fd;
+        }
+        if (r->codec) {
+            uint64_t wait;
+            now = lp_now_ns();
+            if (now >= r->next_open_ns) lp_relay_tunnel_open_all(r, now);
+            wait = r->next_open_ns == UINT64_MAX ? UINT64_MAX : r->next_open_ns - now;
+            if (r->batch.raw_len) {
+                uint64_t flush_in = lp_batch_poll(r->codec, &r->batch, now);
+                if (flush_in < wait) wait = flush_in;
+            }
+            if (wait != UINT64_MAX) {
+                tv.tv_sec = (time_t)(wait / 1000000000ULL);
+                tv.tv_usec = (suseconds_t)((wait % 1000000000ULL) / 1000ULL);
+                tvp = &tv;
+            }
+            FD_SET(r->tunnel_fd, &rfds);
+            if (r->tunnel_fd > maxfd) maxfd = r->tunnel_fd;
+        }
 
-        if (select(maxfd + 1, &rfds, NULL, NULL, NULL) < 0) {
+        if (select(maxfd + 1, &rfds, NULL, NULL, tvp) < 0) {
             if (errno == EINTR) continue;
             lp_runtime_event(r->app, "Relay select error: %s", strerror(errno));
             goto fail;
         }
 
-        if (FD_ISSET(r->wake_pipe[0], &rfds)) {
-            lp_drain_pipe(r->wake_pipe[0]);
-            if (r->stop_flag) break;
+        if (FD_ISSET(r->wake_pipe[0], &rfds)) {
+            lp_drain_pipe(r->wake_pipe[0]);
+            if (r->stop_flag) break;
+            pthread_mutex_lock(&r->app->rt.lock);
+            gen = r->app->rt.routes_gen;
+            pthread_mutex_unlock(&r->app->rt.lock);
+            if (gen != r->routes_gen) {
+                lp_relay_sync_routes(r);
+                continue;
+            }
+        }
+
+        now = r->codec ? lp_now_ns() : 0;
+        for (size_t i = 0; i < r->link_count; i++) {
+            if (r->links[i].local_fd >= 0) lp_link_pump(r, &r->links[i], &rfds, buf, sizeof(buf), now);
+        }
+        if (r->codec) {
+            if (FD_ISSET(r->tunnel_fd, &rfds)) lp_relay_tunnel_rx(r, buf, sizeof(buf));
+            if (r->batch.raw_len) (void)lp_batch_poll(r->codec, &r->batch, now);
+        }
+    }
+
+    pthread_mutex_lock(&r->app->rt.lock);
+    if (r->app->rt.relay == r) {
+        r->app->rt.relay = NULL;
+        lp_set_state_locked(&r->app->rt, LP_STOPPED);
+        lp_set_message_locked(&r->app->rt, "Proxy stopped");
+    }
+    pthread_mutex_unlock(&r->app->rt.lock);
+    LP_TP_DETACH();
+    return NULL;
+
+fail:
+    pthread_mutex_lock(&r->app->rt.lock);
+    if (r->app->rt.relay == r) {
+        lp_runtime_t *rt = &r->app->rt;
+        unsigned shift = rt->relay_failures < 5 ? rt->relay_failures : 5;
+        long delay = (long)LP_RESOLVE_RETRY_MIN_SECS << shift;
+        rt->relay = NULL;
+        rt->failed_relay = r;
+        rt->relay_failures++;
+        rt->relay_retry_at = time(NULL) + (delay > LP_RESOLVE_RETRY_MAX_SECS ? LP_RESOLVE_RETRY_MAX_SECS : delay);
+        rt->upkeep_kick = 1;
+        pthread_cond_signal(&rt->upkeep_cond);
+        lp_set_state_locked(rt, LP_STOPPED);
+    }
+    pthread_mutex_unlock(&r->app->rt.lock);
+    LP_TP_DETACH();
+    return NULL;
+}
+
+static void lp_relay_destroy(lp_relay_t *r) {
+    if (!r) return;
+    for (size_t i = 0; i < r->link_count; i++) lp_link_close(&r->links[i]);
+    lp_closefd(&r->tunnel_fd);
+    lp_codec_free(r->codec);
+    lp_closefd(&r->wake_pipe[0]);
+    lp_closefd(&r->wake_pipe[1]);
+    free(r);
+}
+
+static int lp_relay_start(lp_app_t *app, const char *host, uint16_t port) {
+    lp_relay_t *r = (lp_relay_t *)calloc(1, sizeof(*r));
+    if (!r) return -1;
+    r->app = app;
+    r->wake_pipe[0] = -1;
+    r->wake_pipe[1] = -1;
+    r->tunnel_fd = -1;
+    lp_link_init(&r->links[0], app->cfg.local_proxy_port, host, port);
+    r->link_count = 1;
+    if (pipe(r->wake_pipe) != 0 ||
+        fcntl(r->wake_pipe[0], F_SETFL, O_NONBLOCK) != 0 ||
+        fcntl(r->wake_pipe[1], F_SETFL, O_NONBLOCK) != 0) {
+        lp_relay_destroy(r);
+        return -1;
+    }
+
+    pthread_mutex_lock(&app->rt.lock);
+    app->rt.relay = r;
+    app->rt.want_running = 1;
+    strncpy(app->rt.target_host, host, sizeof(app->rt.target_host) - 1);
+    app->rt.target_port = port;
+    lp_set_state_locked(&app->rt, LP_STARTING);
+    lp_set_message_locked(&app->rt, "Proxy starting...");
+    pthread_mutex_unlock(&app->rt.lock);
+
+    if (lp_thread_create(&r->thread, lp_relay_thread, r) != 0) {
+        pthread_mutex_lock(&app->rt.lock);
+        if (app->rt.relay == r) {
+            app->rt.relay = NULL;
+            lp_set_state_locked(&app->rt, LP_STOPPED);
+            lp_set_message_locked(&app->rt, "Proxy start failed");
+        }
+        pthread_mutex_unlock(&app->rt.lock);
+        lp_relay_destroy(r);
+        return -1;
+    }
+
+    pthread_mutex_lock(&app->rt.lock);
+    if (app->rt.relay == r) {
+        lp_set_state_locked(&app->rt, LP_RUNNING);
+        lp_set_message_locked(&app->rt, "Proxy running");
+    }
+    pthread_mutex_unlock(&app->rt.lock);
+    return 0;
+}
+
+static int lp_udp_bind_host(const char *host, uint16_t port) {
+    struct addrinfo hints, *res = NULL, *it;
+    char port_s[16];
+    int fd = -1, one = 1;
+    snprintf(port_s, sizeof(port_s), "%u", (unsigned)port);
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_PASSIVE;
+    if (getaddrinfo(host, port_s, &hints, &res) != 0) return -1;
+    for (it = res; it; it = it->ai_next) {
+        fd = socket(it->ai_family, it->ai_socktype, it->ai_protocol);
+        if (fd < 0) continue;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, it->ai_addr, it->ai_addrlen) == 0) break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+static lp_tunnel_session_t *lp_tunnel_find(lp_tunnel_server_t *s, const struct sockaddr_storage *peer,
+                                           socklen_t peer_len, uint16_t channel) {
+    for (size_t i = 0; i < LP_TUNNEL_MAX_SESSIONS; i++) {
+        lp_tunnel_session_t *ss = &s->sessions[i];
+        if (ss->in_use && ss->channel == channel && ss->peer_len == peer_len &&
+            memcmp(&ss->peer, peer, peer_len) == 0) {
+            return ss;
+        }
+    }
+    return NULL;
+}
+
+/* Finds the replay state of a client address, or NULL for a client not heard from yet. */
+static lp_tunnel_peer_t *lp_tunnel_peer_find(lp_tunnel_server_t *s, const struct sockaddr_storage *addr,
+                                             socklen_t addr_len) {
+    for (size_t i = 0; i < LP_TUNNEL_MAX_SESSIONS; i++) {
+        lp_tunnel_peer_t *p = &s->peers[i];
+        if (p->in_use && p->addr_len == addr_len && memcmp(&p->addr, addr, addr_len) == 0) return p;
+    }
+    return NULL;
+}
+
+/* Takes a free peer slot, or the one heard from least recently. */
+static lp_tunnel_peer_t *lp_tunnel_peer_add(lp_tunnel_server_t *s, const struct sockaddr_storage *addr,
+                                            socklen_t addr_len) {
+    lp_tunnel_peer_t *victim = NULL;
+    for (size_t i = 0; i < LP_TUNNEL_MAX_SESSIONS; i++) {
+        lp_tunnel_peer_t *it = &s->peers[i];
+        if (!it->in_use) {
+            victim = it;
+            break;
+        }
+        if (!victim || it->last_seen < victim->last_seen) victim = it;
+    }
+    victim->in_use = 1;
+    victim->addr = *addr;
+    victim->addr_len = addr_len;
+    return victim;
+}
+
+static void lp_tunnel_session_close(lp_tunnel_session_t *ss) {
+    lp_closefd(&ss->remote_fd);
+    ss->in_use = 0;
+}
+
+/* OPEN record: [dict_id:be32][port:be16][host]. Creates or retargets the (peer, channel) session. */
+static void lp_tunnel_server_open(lp_tunnel_server_t *s, const struct sockaddr_storage *peer, socklen_t peer_len,
+                                  uint16_t channel, const unsigned char *data, size_t len) {
+    lp_tunnel_session_t *ss, *victim = NULL;
+    uint32_t dict_id;
+    uint16_t port;
+    char host[LP_MAX_HOST + 1];
+
+    if (len < 7 || len - 6 > LP_MAX_HOST) return;
+    dict_id = lp_get_be32(data);
+    if (dict_id != s->app->cfg.tunnel_dict_id) {
+        if (!s->dict_mismatch_logged) lp_log("tunnel peer uses a different dictionary, ignoring its sessions");
+        s->dict_mismatch_logged = 1;
+        return;
+    }
+    port = lp_get_be16(data + 4);
+    memcpy(host, data + 6, len - 6);
+    host[len - 6] = '\0';
+
+    ss = lp_tunnel_find(s, peer, peer_len, channel);
+    if (ss && ss->port == port && strcmp(ss->host, host) == 0) {
+        /* The lookup blocks this thread, so a failing target is retried with a backoff
+         * instead of on every re-announce. */
+        ss->last_seen = time(NULL);
+        if (ss->remote_fd >= 0 || ss->last_seen < ss->retry_at) return;
+        ss->remote_fd = lp_udp_connect_remote(host, port);
+        if (ss->remote_fd >= 0) {
+            lp_log("tunnel session %u -> %s:%u", (unsigned)channel, host, (unsigned)port);
+        } else {
+            if (ss->retry_secs < LP_TUNNEL_RETRY_MAX_SECS) ss->retry_secs *= 2;
+            if (ss->retry_secs > LP_TUNNEL_RETRY_MAX_SECS) ss->retry_secs = LP_TUNNEL_RETRY_MAX_SECS;
+            ss->retry_at = ss->last_seen + ss->retry_secs;
+        }
+        return;
+    }
+    if (!ss) {
+        for (size_t i = 0; i < LP_TUNNEL_MAX_SESSIONS; i++) {
+            lp_tunnel_session_t *it = &s->sessions[i];
+            if (!it->in_use) {
+                victim = it;
+                break;
+            }
+            if (!victim || it->last_seen < victim->last_seen) victim = it;
+        }
+        ss = victim;
+    }
+    lp_tunnel_session_close(ss);
+    ss->in_use = 1;
+    ss->peer = *peer;
+    ss->peer_len = peer_len;
+    ss->channel = channel;
+    ss->port = port;
+    strcpy(ss->host, host);
+    ss->last_seen = time(NULL);
+    ss->remote_fd = lp_udp_connect_remote(host, port);
+    ss->retry_secs = 2;
+    ss->retry_at = ss->last_seen + ss->retry_secs;
+    lp_batch_init(&ss->batch, s->fd, (const struct sockaddr *)peer, peer_len);
+    if (ss->remote_fd < 0) {
+        lp_log("tunnel session %u: connect %s:%u failed, retrying with backoff", (unsigned)channel, host, (unsigned)port);
+    } else {
+        lp_log("tunnel session %u -> %s:%u", (unsigned)channel, host, (unsigned)port);
+    }
+}
+
+static void lp_tunnel_server_rx(lp_tunnel_server_t *s, unsigned char *buf, size_t buf_sz) {
+    struct sockaddr_storage peer;
+    socklen_t peer_len = sizeof(peer);
+    const unsigned char *raw, *p, *end, *data;
+    size_t raw_len, len;
+    unsigned type;
+    uint16_t channel;
+    lp_tunnel_peer_t *from;
+    lp_replay_t rx = {0, 0};
+    ssize_t n = recvfrom(s->fd, buf, buf_sz, 0, (struct sockaddr *)&peer, &peer_len);
+    if (n <= 0) return;
+    LP_TP(LP_TP_RECV, 'i', n);
+    /* A peer slot is only taken once a packet from that address authenticates. */
+    from = lp_tunnel_peer_find(s, &peer, peer_len);
+    if (from) rx = from->rx;
+    raw = lp_tunnel_open(&s->codec, &rx, buf, (size_t)n, &raw_len);
+    if (!raw) {
+        LP_TP(LP_TP_DROP, 'i', n);
+        atomic_fetch_add_explicit(&s->app->tunnel.drops, 1, memory_order_relaxed);
+        return;
+    }
+    if (!from) from = lp_tunnel_peer_add(s, &peer, peer_len);
+    from->rx = rx;
+    from->last_seen = time(NULL);
+    for (p = raw, end = raw + raw_len; (p = lp_tunnel_next_record(p, end, &type, &channel, &data, &len)) != NULL;) {
+        lp_tunnel_session_t *ss;
+        if (type == LP_TUNNEL_REC_OPEN) {
+            lp_tunnel_server_open(s, &peer, peer_len, channel, data, len);
+            continue;
+        }
+        if (type != LP_TUNNEL_REC_DATA) continue;
+        LP_TP(LP_TP_CLASSIFY, 'i', channel);
+        ss = lp_tunnel_find(s, &peer, peer_len, channel);
+        if (!ss || ss->remote_fd < 0) {
+            LP_TP(LP_TP_DROP, 'i', len);
+            continue;
+        }
+        ss->last_seen = time(NULL);
+        if (send(ss->remote_fd, data, len, 0) < 0) LP_TP(LP_TP_DROP, 'i', len);
+        else LP_TP(LP_TP_FORWARD, 'i', len);
+    }
+}
+
+static void *lp_tunnel_server_thread(void *arg) {
+    lp_tunnel_server_t *s = (lp_tunnel_server_t *)arg;
+    unsigned char buf[LP_UDP_BUF];
+
+    lp_thread_name("tunnel");
+    LP_TP_ATTACH("tunnel");
+    for (;;) {
+        fd_set rfds;
+        int maxfd = s->fd;
+        struct timeval tv;
+        uint64_t now = lp_now_ns(), wait = LP_TUNNEL_OPEN_INTERVAL_NS;
+        time_t wall;
+
+        FD_ZERO(&rfds);
+        FD_SET(s->fd, &rfds);
+        for (size_t i = 0; i < LP_TUNNEL_MAX_SESSIONS; i++) {
+            lp_tunnel_session_t *ss = &s->sessions[i];
+            uint64_t flush_in;
+            if (!ss->in_use || ss->remote_fd < 0) continue;
+            FD_SET(ss->remote_fd, &rfds);
+            if (ss->remote_fd > maxfd) maxfd = ss->remote_fd;
+            flush_in = lp_batch_poll(&s->codec, &ss->batch, now);
+            if (flush_in < wait) wait = flush_in;
         }
+        tv.tv_sec = (time_t)(wait / 1000000000ULL);
+        tv.tv_usec = (suseconds_t)((wait % 1000000000ULL) / 1000ULL);
 
-        if (FD_ISSET(r->local_fd, &rfds)) {
-            struct sockaddr_storage src;
-            socklen_t src_len = sizeof(src);
-            ssize_t n = recvfrom(r->local_fd, buf, sizeof(buf), 0, (struct sockaddr *)&src, &src_len);
-            if (n > 0) {
-                r->client_addr = src;
-                r->client_addr_len = src_len;
-                r->has_client = 1;
-                (void)send(r->remote_fd, buf, (size_t)n, 0);
-            }
+        if (select(maxfd + 1, &rfds, NULL, NULL, &tv) < 0) {
+            if (errno == EINTR) continue;
+            lp_log("tunnel select error: %s", strerror(errno));
+            sleep(1);
+            continue;
         }
 
-        if (FD_ISSET(r->remote_fd, &rfds)) {
-            ssize_t n = recv(r->remote_fd, buf, sizeof(buf), 0);
-            if (n > 0 && r->has_client) {
-                (void)sendto(r->local_fd, buf, (size_t)n, 0,
-                             (struct sockaddr *)&r->client_addr, r->client_addr_len);
+        if (FD_ISSET(s->fd, &rfds)) lp_tunnel_server_rx(s, buf, sizeof(buf));
+
+        now = lp_now_ns();
+        wall = time(NULL);
+        for (size_t i = 0; i < LP_TUNNEL_MAX_SESSIONS; i++) {
+            lp_tunnel_session_t *ss = &s->sessions[i];
+            if (!ss->in_use) continue;
+            if (ss->remote_fd >= 0 && FD_ISSET(ss->remote_fd, &rfds)) {
+                ssize_t n = recv(ss->remote_fd, buf, sizeof(buf), 0);
+                if (n > 0) {
+                    LP_TP(LP_TP_RECV, 'i', n);
+                    lp_batch_add(&s->codec, &ss->batch, LP_TUNNEL_REC_DATA, ss->channel, buf, (size_t)n, now);
+                    ss->last_seen = wall;
+                }
+            }
+            (void)lp_batch_poll(&s->codec, &ss->batch, now);
+            if (wall - ss->last_seen > LP_TUNNEL_IDLE_SECS) {
+                lp_log("tunnel session %u idle, closing", (unsigned)ss->channel);
+                lp_tunnel_session_close(ss);
             }
         }
     }
-
-    pthread_mutex_lock(&r->app->rt.lock);
-    if (r->app->rt.relay == r) {
-        r->app->rt.relay = NULL;
-        lp_set_state_locked(&r->app->rt, LP_STOPPED);
-        lp_set_message_locked(&r->app->rt, "Proxy stopped");
-    }
-    pthread_mutex_unlock(&r->app->rt.lock);
-    return NULL;
-
-fail:
-    pthread_mutex_lock(&r->app->rt.lock);
-    if (r->app->rt.relay == r) {
-        r->app->rt.relay = NULL;
-        lp_set_state_locked(&r->app->rt, LP_STOPPED);
-    }
-    pthread_mutex_unlock(&r->app->rt.lock);
     return NULL;
 }
 
-static void lp_relay_destroy(lp_relay_t *r) {
-    if (!r) return;
-    lp_closefd(&r->local_fd);
-    lp_closefd(&r->remote_fd);
-    lp_closefd(&r->wake_pipe[0]);
-    lp_closefd(&r->wake_pipe[1]);
-    free(r);
-}
-
-static int lp_relay_start(lp_app_t *app, const char *host, uint16_t port) {
-    lp_relay_t *r = (lp_relay_t *)calloc(1, sizeof(*r));
-    if (!r) return -1;
-    r->app = app;
-    r->local_fd = -1;
-    r->remote_fd = -1;
-    r->wake_pipe[0] = -1;
-    r->wake_pipe[1] = -1;
-    r->local_port = app->cfg.local_proxy_port;
-    r->remote_port = port;
-    strncpy(r->remote_host, host, sizeof(r->remote_host) - 1);
-    if (pipe(r->wake_pipe) != 0) {
-        lp_relay_destroy(r);
-        return -1;
-    }
-
-    pthread_mutex_lock(&app->rt.lock);
-    app->rt.relay = r;
-    strncpy(app->rt.target_host, host, sizeof(app->rt.target_host) - 1);
-    app->rt.target_port = port;
-    lp_set_state_locked(&app->rt, LP_STARTING);
-    lp_set_message_locked(&app->rt, "Proxy starting...");
-    pthread_mutex_unlock(&app->rt.lock);
-
-    if (pthread_create(&r->thread, NULL, lp_relay_thread, r) != 0) {
-        pthread_mutex_lock(&app->rt.lock);
-        if (app->rt.relay == r) {
-            app->rt.relay = NULL;
-            lp_set_state_locked(&app->rt, LP_STOPPED);
-            lp_set_message_locked(&app->rt, "Proxy start failed");
-        }
-        pthread_mutex_unlock(&app->rt.lock);
-        lp_relay_destroy(r);
+/* Server side of the tunnel: runs for the daemon's lifetime, independent of /proxy/start. */
+static int lp_tunnel_server_start(lp_app_t *app) {
+    lp_tunnel_server_t *s = (lp_tunnel_server_t *)calloc(1, sizeof(*s));
+    if (!s) return -1;
+    s->app = app;
+    for (size_t i = 0; i < LP_TUNNEL_MAX_SESSIONS; i++) s->sessions[i].remote_fd = -1;
+    s->fd = lp_udp_bind_host(app->cfg.tunnel_bind_host, app->cfg.tunnel_listen_port);
+    if (s->fd < 0 || lp_codec_init(&s->codec, app) != 0 ||
+        lp_thread_create(&s->thread, lp_tunnel_server_thread, s) != 0) {
+        lp_log("failed to start tunnel server on %s:%u", app->cfg.tunnel_bind_host, (unsigned)app->cfg.tunnel_listen_port);
+        lp_closefd(&s->fd);
+        free(s->codec.win);
+        free(s);
         return -1;
     }
-
-    pthread_mutex_lock(&app->rt.lock);
-    if (app->rt.relay == r) {
-        lp_set_state_locked(&app->rt, LP_RUNNING);
-        lp_set_message_locked(&app->rt, "Proxy running");
-    }
-    pthread_mutex_unlock(&app->rt.lock);
+    pthread_detach(s->thread);
+    lp_log("Tunnel server listening on udp://%s:%u (mtu=%ld batch=%ldus compress=%d dict=%zu bytes)",
+           app->cfg.tunnel_bind_host, (unsigned)app->cfg.tunnel_listen_port,
+           app->cfg.tunnel_mtu, app->cfg.tunnel_batch_us, app->cfg.tunnel_compress, app->cfg.tunnel_dict_len);
     return 0;
 }
 
@@ -423,9 +1857,24 @@ static void lp_relay_request_stop(lp_relay_t *r) {
     if (r->wake_pipe[1] >= 0) (void)write(r->wake_pipe[1], "x", 1);
 }
 
+/* Joins a relay thread that exited on an error; callers hold ctl_lock. */
+static void lp_runtime_reap(lp_app_t *app) {
+    lp_relay_t *r;
+    pthread_mutex_lock(&app->rt.lock);
+    r = app->rt.failed_relay;
+    app->rt.failed_relay = NULL;
+    pthread_mutex_unlock(&app->rt.lock);
+    if (!r) return;
+    pthread_join(r->thread, NULL);
+    lp_relay_destroy(r);
+}
+
 static int lp_runtime_stop(lp_app_t *app) {
     lp_relay_t *r = NULL;
+    lp_runtime_reap(app);
     pthread_mutex_lock(&app->rt.lock);
+    app->rt.want_running = 0;
+    app->rt.relay_failures = 0;
     if (app->rt.relay == NULL) {
         lp_set_state_locked(&app->rt, LP_STOPPED);
         lp_set_message_locked(&app->rt, "Proxy already stopped");
@@ -447,6 +1896,7 @@ static int lp_runtime_start(lp_app_t *app, const char *host, uint16_t port) {
     int running = 0;
     int same = 0;
 
+    lp_runtime_reap(app);
     pthread_mutex_lock(&app->rt.lock);
     if ((!host || !host[0]) && app->rt.target_host[0]) {
         host = app->rt.target_host;
@@ -477,6 +1927,46 @@ static int lp_runtime_start(lp_app_t *app, const char *host, uint16_t port) {
     return lp_relay_start(app, host, port);
 }
 
+static void lp_runtime_routes_changed_locked(lp_runtime_t *rt) {
+    rt->routes_gen++;
+    if (rt->relay && rt->relay->wake_pipe[1] >= 0) (void)write(rt->relay->wake_pipe[1], "r", 1);
+    rt->upkeep_kick = 1;
+    pthread_cond_signal(&rt->upkeep_cond);
+    lp_touch_locked(rt);
+}
+
+/* Returns -1 (table full), -2 (match key taken), -3 (listen port is localProxyPort) or -4 (unresolvable). */
+static int lp_runtime_set_route(lp_app_t *app, lp_route_t *route) {
+    int rc;
+    if (route->listen_port == app->cfg.local_proxy_port) return -3;
+    /* Resolve here so the relay thread only opens sockets; the tunnel server resolves in client mode. */
+    if (app->cfg.tunnel_mode != LP_TUNNEL_CLIENT &&
+        lp_udp_resolve(route->server_host, route->server_port, &route->server_addr, &route->server_addr_len) != 0) {
+        return -4;
+    }
+    pthread_mutex_lock(&app->rt.lock);
+    rc = lp_route_upsert(&app->rt.routes, route);
+    if (rc == 0) {
+        lp_runtime_routes_changed_locked(&app->rt);
+        lp_set_message_locked(&app->rt, "Route 127.0.0.1:%u -> %s:%u set",
+                              (unsigned)route->listen_port, route->server_host, (unsigned)route->server_port);
+    }
+    pthread_mutex_unlock(&app->rt.lock);
+    return rc;
+}
+
+static int lp_runtime_remove_route(lp_app_t *app, uint16_t listen_port) {
+    int rc;
+    pthread_mutex_lock(&app->rt.lock);
+    rc = lp_route_remove(&app->rt.routes, listen_port);
+    if (rc == 0) {
+        lp_runtime_routes_changed_locked(&app->rt);
+        lp_set_message_locked(&app->rt, "Route 127.0.0.1:%u removed", (unsigned)listen_port);
+    }
+    pthread_mutex_unlock(&app->rt.lock);
+    return rc;
+}
+
 static int lp_runtime_toggle(lp_app_t *app, const char *host, uint16_t port) {
     int running;
     pthread_mutex_lock(&app->rt.lock);
@@ -485,6 +1975,324 @@ static int lp_runtime_toggle(lp_app_t *app, const char *host, uint16_t port) {
     return running ? lp_runtime_stop(app) : lp_runtime_start(app, host, port);
 }
 
+/* Resolves config and snapshot routes that have no address yet; returns how many still fail. */
+static size_t lp_upkeep_resolve_routes(lp_app_t *app, int log_failures) {
+    lp_route_table_t tbl;
+    size_t pending = 0;
+    int changed = 0;
+
+    if (app->cfg.tunnel_mode == LP_TUNNEL_CLIENT) return 0;
+    pthread_mutex_lock(&app->rt.lock);
+    tbl = app->rt.routes;
+    pthread_mutex_unlock(&app->rt.lock);
+
+    for (size_t i = 0; i < tbl.count; i++) {
+        lp_route_t *route = &tbl.entries[i];
+        if (route->server_addr_len) continue;
+        if (lp_udp_resolve(route->server_host, route->server_port, &route->server_addr, &route->server_addr_len) != 0) {
+            if (log_failures) {
+                lp_log("route 127.0.0.1:%u: cannot resolve %s yet, retrying",
+                       (unsigned)route->listen_port, route->server_host);
+            }
+            pending++;
+            continue;
+        }
+        /* The table may have been edited during the lookup; only fill in the same, still unresolved route. */
+        pthread_mutex_lock(&app->rt.lock);
+        for (size_t j = 0; j < app->rt.routes.count; j++) {
+            lp_route_t *live = &app->rt.routes.entries[j];
+            if (live->listen_port == route->listen_port && live->server_port == route->server_port &&
+                live->server_addr_len == 0 && strcmp(live->server_host, route->server_host) == 0) {
+                live->server_addr = route->server_addr;
+                live->server_addr_len = route->server_addr_len;
+                changed = 1;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&app->rt.lock);
+    }
+    if (changed) {
+        pthread_mutex_lock(&app->rt.lock);
+        lp_runtime_routes_changed_locked(&app->rt);
+        pthread_mutex_unlock(&app->rt.lock);
+    }
+    return pending;
+}
+
+/* Restarts a relay that failed while a start is still wanted, once its backoff has passed.
+ * Returns when to check again, or 0 when there is nothing to retry. */
+static time_t lp_upkeep_restart_relay(lp_app_t *app, time_t now) {
+    time_t at = 0;
+    unsigned failures;
+
+    pthread_mutex_lock(&app->rt.ctl_lock);
+    pthread_mutex_lock(&app->rt.lock);
+    if (app->rt.want_running && !app->rt.relay && app->rt.relay_failures) at = app->rt.relay_retry_at;
+    failures = app->rt.relay_failures;
+    pthread_mutex_unlock(&app->rt.lock);
+    if (at && now >= at) {
+        lp_log("relay failed %u time(s), restarting", failures);
+        (void)lp_runtime_start(app, NULL, 0);
+        at = 0; /* a relay that fails again kicks upkeep with a new retry time */
+    }
+    pthread_mutex_unlock(&app->rt.ctl_lock);
+    return at;
+}
+
+/* Background housekeeping that must not block the relay or the control server: routes that do
+ * not resolve (no network yet at boot) are retried after 2s, doubling up to 60s, and a relay
+ * that fails while it should be running is restarted on the same schedule. */
+static void *lp_upkeep_thread(void *arg) {
+    lp_app_t *app = (lp_app_t *)arg;
+    int backoff = LP_RESOLVE_RETRY_MIN_SECS;
+    time_t resolve_at = 0;
+
+    lp_thread_name("upkeep");
+    for (;;) {
+        time_t now = time(NULL), wake;
+        int stop;
+
+        if (now >= resolve_at) {
+            if (lp_upkeep_resolve_routes(app, backoff == LP_RESOLVE_RETRY_MIN_SECS)) {
+                resolve_at = now + backoff;
+                backoff = backoff * 2 > LP_RESOLVE_RETRY_MAX_SECS ? LP_RESOLVE_RETRY_MAX_SECS : backoff * 2;
+            } else {
+                resolve_at = 0;
+                backoff = LP_RESOLVE_RETRY_MIN_SECS;
+            }
+        }
+        wake = lp_upkeep_restart_relay(app, now);
+        if (resolve_at && (!wake || resolve_at < wake)) wake = resolve_at;
+
+        pthread_mutex_lock(&app->rt.lock);
+        while (!app->rt.upkeep_kick && !app->rt.upkeep_stop) {
+            struct timespec deadline = {wake, 0};
+            if (!wake) pthread_cond_wait(&app->rt.upkeep_cond, &app->rt.lock);
+            else if (pthread_cond_timedwait(&app->rt.upkeep_cond, &app->rt.lock, &deadline) == ETIMEDOUT) break;
+        }
+        app->rt.upkeep_kick = 0;
+        stop = app->rt.upkeep_stop;
+        pthread_mutex_unlock(&app->rt.lock);
+        if (stop) break;
+    }
+    return NULL;
+}
+
+static void lp_upkeep_start(lp_app_t *app) {
+    if (lp_thread_create(&app->upkeep, lp_upkeep_thread, app) != 0) {
+        lp_log("failed to start upkeep thread; unresolved routes and failed relays are not retried");
+        return;
+    }
+    app->upkeep_running = 1;
+}
+
+static void lp_upkeep_stop(lp_app_t *app) {
+    if (!app->upkeep_running) return;
+    pthread_mutex_lock(&app->rt.lock);
+    app->rt.upkeep_stop = 1;
+    pthread_cond_signal(&app->rt.upkeep_cond);
+    pthread_mutex_unlock(&app->rt.lock);
+    pthread_join(app->upkeep, NULL);
+    app->upkeep_running = 0;
+}
+
+/* Hash of the config keys a snapshot overrides; a config edit invalidates the snapshot's target and routes. */
+static uint32_t lp_config_state_hash(const lp_config_t *cfg) {
+    uint32_t h = 2166136261u;
+    h = lp_fnv1a_step(h, &cfg->local_proxy_port, sizeof(cfg->local_proxy_port));
+    h = lp_fnv1a_step(h, cfg->remote_default_host, strlen(cfg->remote_default_host) + 1);
+    h = lp_fnv1a_step(h, &cfg->remote_default_port, sizeof(cfg->remote_default_port));
+    for (size_t i = 0; i < cfg->routes.count; i++) {
+        const lp_route_t *r = &cfg->routes.entries[i];
+        h = lp_fnv1a_step(h, &r->listen_port, sizeof(r->listen_port));
+        h = lp_fnv1a_step(h, r->server_host, strlen(r->server_host) + 1);
+        h = lp_fnv1a_step(h, &r->server_port, sizeof(r->server_port));
+        h = lp_fnv1a_step(h, r->match_host, strlen(r->match_host) + 1);
+        h = lp_fnv1a_step(h, &r->match_port, sizeof(r->match_port));
+    }
+    return h;
+}
+
+static uint32_t lp_snapshot_checksum(const lp_snapshot_slot_t *slot) {
+    size_t off = offsetof(lp_snapshot_slot_t, seq);
+    return lp_fnv1a((const unsigned char *)slot + off, sizeof(*slot) - off);
+}
+
+static int lp_snapshot_valid(const lp_snapshot_slot_t *slot) {
+    return slot->magic == LP_SNAPSHOT_MAGIC &&
+           slot->version == LP_SNAPSHOT_VERSION &&
+           slot->size == sizeof(*slot) &&
+           slot->routes.count <= LP_MAX_ROUTES &&
+           slot->checksum == lp_snapshot_checksum(slot);
+}
+
+/* Maps the snapshot file (creating it if needed) and returns the newest valid slot, if any. */
+static const lp_snapshot_slot_t *lp_snapshot_open(lp_app_t *app) {
+    const lp_snapshot_slot_t *best = NULL;
+    size_t len = sizeof(lp_snapshot_slot_t) * LP_SNAPSHOT_SLOTS;
+    struct stat st;
+    void *map;
+    int fd;
+
+    if (!app->cfg.snapshot_path[0]) return NULL;
+    fd = open(app->cfg.snapshot_path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0 || fstat(fd, &st) != 0 || ((size_t)st.st_size != len && ftruncate(fd, (off_t)len) != 0)) {
+        lp_log("snapshot disabled: cannot open %s (%s)", app->cfg.snapshot_path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return NULL;
+    }
+    map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        lp_log("snapshot disabled: mmap %s failed (%s)", app->cfg.snapshot_path, strerror(errno));
+        return NULL;
+    }
+    app->snap.slots = (lp_snapshot_slot_t *)map;
+    for (size_t i = 0; i < LP_SNAPSHOT_SLOTS; i++) {
+        const lp_snapshot_slot_t *slot = &app->snap.slots[i];
+        if (lp_snapshot_valid(slot) && (!best || slot->seq > best->seq)) best = slot;
+    }
+    if (best) app->snap.seq = best->seq;
+    return best;
+}
+
+/* Records the requested state (not relay failures) into the older slot, so a torn write keeps the other. */
+static void lp_snapshot_save(lp_app_t *app) {
+    lp_snapshot_slot_t next;
+    lp_snapshot_slot_t *slot;
+
+    if (!app->snap.slots) return;
+    memset(&next, 0, sizeof(next));
+    pthread_mutex_lock(&app->rt.lock);
+    next.running = app->rt.want_running;
+    next.target_port = app->rt.target_port;
+    memcpy(next.target_host, app->rt.target_host, sizeof(next.target_host));
+    next.routes = app->rt.routes;
+    pthread_mutex_unlock(&app->rt.lock);
+    next.config_hash = lp_config_state_hash(&app->cfg);
+
+    next.magic = LP_SNAPSHOT_MAGIC;
+    next.version = LP_SNAPSHOT_VERSION;
+    next.size = sizeof(next);
+    next.seq = ++app->snap.seq;
+    next.checksum = lp_snapshot_checksum(&next);
+
+    slot = &app->snap.slots[next.seq % LP_SNAPSHOT_SLOTS];
+    memcpy(slot, &next, sizeof(next));
+    (void)msync(app->snap.slots, sizeof(next) * LP_SNAPSHOT_SLOTS, MS_ASYNC);
+}
+
+/* Re-applies the POST /routes checks (listen port, match key, capacity); the upkeep thread resolves them. */
+static void lp_snapshot_restore_routes(lp_app_t *app, const lp_route_table_t *saved, lp_route_table_t *out) {
+    memset(out, 0, sizeof(*out));
+    for (size_t i = 0; i < saved->count && i < LP_MAX_ROUTES; i++) {
+        lp_route_t route = saved->entries[i];
+        route.server_host[sizeof(route.server_host) - 1] = '\0';
+        route.match_host[sizeof(route.match_host) - 1] = '\0';
+        route.server_addr_len = 0;
+        if (!route.listen_port || !route.server_port || !route.server_host[0] ||
+            route.listen_port == app->cfg.local_proxy_port || lp_route_upsert(out, &route) != 0) {
+            lp_log("snapshot restore: dropping route 127.0.0.1:%u -> %s:%u",
+                   (unsigned)route.listen_port, route.server_host, (unsigned)route.server_port);
+        }
+    }
+}
+
+/* Runs before the control server binds so a respawned daemon resumes relaying immediately. */
+static void lp_snapshot_restore(lp_app_t *app) {
+    uint64_t t0 = lp_now_ns();
+    const lp_snapshot_slot_t *mapped = lp_snapshot_open(app);
+    lp_snapshot_slot_t slot;
+    char host[LP_MAX_HOST + 1];
+    int stale;
+
+    if (!mapped) return;
+    slot = *mapped;
+    stale = slot.config_hash != lp_config_state_hash(&app->cfg);
+    pthread_mutex_lock(&app->rt.lock);
+    if (stale) {
+        lp_log("config changed since snapshot seq=%llu; using the config's target and routes", (unsigned long long)slot.seq);
+    } else {
+        lp_snapshot_restore_routes(app, &slot.routes, &app->rt.routes);
+        if (slot.target_host[0]) {
+            memcpy(app->rt.target_host, slot.target_host, sizeof(app->rt.target_host));
+            app->rt.target_host[sizeof(app->rt.target_host) - 1] = '\0';
+            app->rt.target_port = slot.target_port;
+        }
+    }
+    memcpy(host, app->rt.target_host, sizeof(host));
+    slot.target_port = app->rt.target_port;
+    slot.routes.count = app->rt.routes.count;
+    pthread_mutex_unlock(&app->rt.lock);
+
+    if (slot.running && lp_runtime_start(app, host, slot.target_port) != 0) {
+        lp_log("snapshot restore: relay start failed");
+    }
+    if (stale) lp_snapshot_save(app);
+    lp_log("restored snapshot seq=%llu state=%s target=%s:%u routes=%zu in %.3fms",
+           (unsigned long long)slot.seq, slot.running ? "running" : "stopped",
+           host[0] ? host : "(unset)", (unsigned)slot.target_port, slot.routes.count,
+           (double)(lp_now_ns() - t0) / 1e6);
+}
+
+/* XNU ignores RLIMIT_DATA for mmap-backed malloc, so Darwin relies on jetsam: JetsamMemoryLimit in the
+ * launchd plist, or memorystatus_control when running as root. Only a limit that is in force is reported. */
+static void lp_memory_apply_limit(lp_app_t *app) {
+#if defined(__APPLE__)
+    lp_memlimit_properties_t props;
+    if (app->cfg.memory_limit_mb > 0 &&
+        memorystatus_control(LP_MEMORYSTATUS_CMD_SET_JETSAM_TASK_LIMIT, getpid(),
+                             (uint32_t)app->cfg.memory_limit_mb, NULL, 0) != 0) {
+        lp_log("memoryLimitMB not applied (%s); relying on JetsamMemoryLimit", strerror(errno));
+    }
+    memset(&props, 0, sizeof(props));
+    if (memorystatus_control(LP_MEMORYSTATUS_CMD_GET_MEMLIMIT_PROPERTIES, getpid(), 0, &props, sizeof(props)) == 0 &&
+        props.memlimit_active > 0) {
+        app->memory_limit_bytes = (uint64_t)props.memlimit_active * 1024ULL * 1024ULL;
+    }
+#elif defined(__linux__)
+    struct rlimit rl;
+    if (app->cfg.memory_limit_mb <= 0) return;
+    rl.rlim_cur = (rlim_t)app->cfg.memory_limit_mb * 1024 * 1024;
+    rl.rlim_max = rl.rlim_cur;
+    if (setrlimit(RLIMIT_DATA, &rl) != 0) {
+        lp_log("failed to cap memory at %ldMB: %s", app->cfg.memory_limit_mb, strerror(errno));
+        return;
+    }
+    app->memory_limit_bytes = (uint64_t)rl.rlim_cur;
+#else
+    (void)app;
+#endif
+}
+
+static uint64_t lp_memory_resident(void) {
+#if defined(__APPLE__)
+    mach_task_basic_info_data_t info;
+    mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+    if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, (task_info_t)&info, &count) != KERN_SUCCESS) return 0;
+    return (uint64_t)info.resident_size;
+#elif defined(__linux__)
+    unsigned long long size = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (!f) return 0;
+    if (fscanf(f, "%llu %llu", &size, &resident) != 2) resident = 0;
+    fclose(f);
+    return (uint64_t)resident * (uint64_t)sysconf(_SC_PAGESIZE);
+#else
+    return 0;
+#endif
+}
+
+static uint64_t lp_memory_peak(void) {
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) != 0) return 0;
+#ifdef __APPLE__
+    return (uint64_t)ru.ru_maxrss;
+#else
+    return (uint64_t)ru.ru_maxrss * 1024ULL;
+#endif
+}
+
 static void lp_iso8601(time_t ts, char *out, size_t out_sz) {
     struct tm tmv;
     memset(&tmv, 0, sizeof(tmv));
@@ -509,13 +2317,94 @@ static void lp_json_escape(const char *src, char *out, size_t out_sz) {
     out[j] = '\0';
 }
 
+static void lp_routes_json(const lp_route_table_t *t, char *out, size_t out_sz) {
+    size_t used;
+    int n = snprintf(out, out_sz, "{\"routes\":[");
+    if (n < 0 || (size_t)n >= out_sz) return;
+    used = (size_t)n;
+    for (size_t i = 0; i < t->count; i++) {
+        const lp_route_t *route = &t->entries[i];
+        char host[LP_MAX_HOST * 2 + 8], match[LP_MATCH_HOST * 2 + 8];
+        lp_json_escape(route->server_host, host, sizeof(host));
+        if (route->match_host[0]) {
+            char esc[LP_MATCH_HOST * 2 + 4];
+            lp_json_escape(route->match_host, esc, sizeof(esc));
+            snprintf(match, sizeof(match), "\"%s\"", esc);
+        } else {
+            strcpy(match, "null");
+        }
+        n = snprintf(out + used, out_sz - used,
+                     "%s{\"listenPort\":%u,\"serverHost\":\"%s\",\"serverPort\":%u,\"matchHost\":%s,\"matchPort\":%u}",
+                     i ? "," : "", (unsigned)route->listen_port, host, (unsigned)route->server_port,
+                     match, (unsigned)route->match_port);
+        if (n < 0 || used + (size_t)n >= out_sz) return;
+        used += (size_t)n;
+    }
+    snprintf(out + used, out_sz - used, "]}");
+}
+
+/* Writes the route table next to the config (tmp + rename) so the tweak can pick it up. */
+static void lp_routes_publish(lp_app_t *app) {
+    char json[LP_ROUTES_JSON_BUF];
+    char tmp[LP_PATH_BUF + 8];
+    lp_route_table_t tbl;
+    FILE *f;
+    int ok;
+
+    if (!app->cfg.routes_path[0]) return;
+    pthread_mutex_lock(&app->rt.lock);
+    tbl = app->rt.routes;
+    pthread_mutex_unlock(&app->rt.lock);
+
+    lp_routes_json(&tbl, json, sizeof(json));
+    snprintf(tmp, sizeof(tmp), "%s.tmp", app->cfg.routes_path);
+    f = fopen(tmp, "wb");
+    if (!f) {
+        lp_log("failed to write routes file: %s (%s)", tmp, strerror(errno));
+        return;
+    }
+    ok = fputs(json, f) >= 0;
+    if (fclose(f) != 0) ok = 0;
+    if (!ok || rename(tmp, app->cfg.routes_path) != 0) {
+        lp_log("failed to publish routes file: %s", app->cfg.routes_path);
+        unlink(tmp);
+    }
+}
+
+static const char *lp_tunnel_mode_name(lp_tunnel_mode_t mode) {
+    switch (mode) {
+        case LP_TUNNEL_CLIENT: return "client";
+        case LP_TUNNEL_SERVER: return "server";
+        default: return "off";
+    }
+}
+
+static void lp_tunnel_json(lp_app_t *app, char *out, size_t out_sz) {
+    if (app->cfg.tunnel_mode == LP_TUNNEL_OFF) {
+        snprintf(out, out_sz, "null");
+        return;
+    }
+    snprintf(out, out_sz,
+             "{\"mode\":\"%s\",\"maxDatagram\":%ld,\"txRawBytes\":%llu,\"txWireBytes\":%llu,\"txPackets\":%llu,"
+             "\"drops\":%llu,\"authFailures\":%llu}",
+             lp_tunnel_mode_name(app->cfg.tunnel_mode),
+             app->cfg.tunnel_mtu - LP_TUNNEL_OVERHEAD,
+             (unsigned long long)atomic_load_explicit(&app->tunnel.raw_bytes, memory_order_relaxed),
+             (unsigned long long)atomic_load_explicit(&app->tunnel.wire_bytes, memory_order_relaxed),
+             (unsigned long long)atomic_load_explicit(&app->tunnel.packets, memory_order_relaxed),
+             (unsigned long long)atomic_load_explicit(&app->tunnel.drops, memory_order_relaxed),
+             (unsigned long long)atomic_load_explicit(&app->tunnel.auth_failures, memory_order_relaxed));
+}
+
 static void lp_status_json(lp_app_t *app, char *out, size_t out_sz) {
-    char ts[32], host[LP_MAX_HOST * 2 + 8], msg[LP_MSG_BUF * 2 + 8];
+    char ts[32], host[LP_MAX_HOST * 2 + 8], msg[LP_MSG_BUF * 2 + 8], tunnel[256], memory[128];
+    int n;
     lp_state_t st;
     char target_host[LP_MAX_HOST + 1];
     uint16_t target_port, local_port;
     char message[LP_MSG_BUF];
     time_t updated_at;
+    size_t route_count;
 
     pthread_mutex_lock(&app->rt.lock);
     st = app->rt.state;
@@ -526,19 +2415,25 @@ static void lp_status_json(lp_app_t *app, char *out, size_t out_sz) {
     message[sizeof(message) - 1] = '\0';
     updated_at = app->rt.updated_at;
     local_port = app->cfg.local_proxy_port;
+    route_count = app->rt.routes.count;
     pthread_mutex_unlock(&app->rt.lock);
 
     lp_iso8601(updated_at, ts, sizeof(ts));
     lp_json_escape(target_host, host, sizeof(host));
     lp_json_escape(message, msg, sizeof(msg));
+    lp_tunnel_json(app, tunnel, sizeof(tunnel));
+    n = snprintf(memory, sizeof(memory), "{\"residentBytes\":%llu,\"peakResidentBytes\":%llu,\"limitBytes\":",
+                 (unsigned long long)lp_memory_resident(), (unsigned long long)lp_memory_peak());
+    if (app->memory_limit_bytes) snprintf(memory + n, sizeof(memory) - (size_t)n, "%llu}", (unsigned long long)app->memory_limit_bytes);
+    else snprintf(memory + n, sizeof(memory) - (size_t)n, "null}");
     if (target_host[0]) {
         snprintf(out, out_sz,
-                 "{\"state\":\"%s\",\"localProxyPort\":%u,\"target\":{\"serverHost\":\"%s\",\"serverPort\":%u},\"updatedAt\":\"%s\",\"message\":\"%s\"}",
-                 lp_state_name(st), (unsigned)local_port, host, (unsigned)target_port, ts, msg);
+                 "{\"state\":\"%s\",\"localProxyPort\":%u,\"target\":{\"serverHost\":\"%s\",\"serverPort\":%u},\"routeCount\":%zu,\"tunnel\":%s,\"memory\":%s,\"updatedAt\":\"%s\",\"message\":\"%s\"}",
+                 lp_state_name(st), (unsigned)local_port, host, (unsigned)target_port, route_count, tunnel, memory, ts, msg);
     } else {
         snprintf(out, out_sz,
-                 "{\"state\":\"%s\",\"localProxyPort\":%u,\"target\":null,\"updatedAt\":\"%s\",\"message\":\"%s\"}",
-                 lp_state_name(st), (unsigned)local_port, ts, msg);
+                 "{\"state\":\"%s\",\"localProxyPort\":%u,\"target\":null,\"routeCount\":%zu,\"tunnel\":%s,\"memory\":%s,\"updatedAt\":\"%s\",\"message\":\"%s\"}",
+                 lp_state_name(st), (unsigned)local_port, route_count, tunnel, memory, ts, msg);
     }
 }
 
@@ -624,20 +2519,169 @@ static int lp_http_authorized(lp_app_t *app, lp_http_req_t *req) {
     return strcmp(req->auth, expected) == 0;
 }
 
+static int lp_http_copy_body(lp_http_req_t *req, char *out, size_t out_sz) {
+    if (!req->body || req->body_len == 0 || req->body_len >= out_sz) return 0;
+    memcpy(out, req->body, req->body_len);
+    out[req->body_len] = '\0';
+    return 1;
+}
+
 static void lp_parse_start_body(lp_http_req_t *req, char *host, size_t host_sz, uint16_t *port) {
     char body[8192];
     long v;
-    if (!req->body || req->body_len == 0 || req->body_len >= sizeof(body)) return;
-    memcpy(body, req->body, req->body_len);
-    body[req->body_len] = '\0';
+    if (!lp_http_copy_body(req, body, sizeof(body))) return;
     if (host && host_sz) lp_json_get_string(body, "serverHost", host, host_sz);
     if (port && lp_json_get_int(body, "serverPort", &v) && v > 0 && v <= 65535) *port = (uint16_t)v;
 }
 
+static void lp_http_handle_routes(lp_app_t *app, int fd, lp_http_req_t *req) {
+    char json[LP_ROUTES_JSON_BUF];
+    char body[8192];
+    lp_route_table_t tbl;
+    lp_route_t route;
+    long v;
+    int rc;
+
+    if (strcmp(req->method, "POST") == 0) {
+        if (!lp_http_copy_body(req, body, sizeof(body)) || lp_route_parse(body, &route) != 0) {
+            lp_http_send_err(fd, 400, "Bad Request", "invalid_route");
+            return;
+        }
+        rc = lp_runtime_set_route(app, &route);
+        if (rc == -4) {
+            lp_http_send_err(fd, 502, "Bad Gateway", "resolve_failed");
+            return;
+        }
+        if (rc == -3) {
+            lp_http_send_err(fd, 409, "Conflict", "listen_port_in_use");
+            return;
+        }
+        if (rc == -2) {
+            lp_http_send_err(fd, 409, "Conflict", "match_in_use");
+            return;
+        }
+        if (rc != 0) {
+            lp_http_send_err(fd, 409, "Conflict", "route_table_full");
+            return;
+        }
+        lp_routes_publish(app);
+        lp_snapshot_save(app);
+    } else if (strcmp(req->method, "DELETE") == 0) {
+        if (!lp_http_copy_body(req, body, sizeof(body)) ||
+            !lp_json_get_int(body, "listenPort", &v) || v <= 0 || v > 65535) {
+            lp_http_send_err(fd, 400, "Bad Request", "invalid_route");
+            return;
+        }
+        if (lp_runtime_remove_route(app, (uint16_t)v) != 0) {
+            lp_http_send_err(fd, 404, "Not Found", "route_not_found");
+            return;
+        }
+        lp_routes_publish(app);
+        lp_snapshot_save(app);
+    } else if (strcmp(req->method, "GET") != 0) {
+        lp_http_send_err(fd, 405, "Method Not Allowed", "method_not_allowed");
+        return;
+    }
+
+    pthread_mutex_lock(&app->rt.lock);
+    tbl = app->rt.routes;
+    pthread_mutex_unlock(&app->rt.lock);
+    lp_routes_json(&tbl, json, sizeof(json));
+    (void)lp_http_send(fd, 200, "OK", json);
+}
+
+#if LP_TRACE
+typedef struct {
+    char *p;
+    size_t len, cap;
+    int failed;
+} lp_strbuf_t;
+
+static void lp_strbuf_appendf(lp_strbuf_t *b, const char *fmt, ...) {
+    va_list ap;
+    int n;
+    if (b->failed) return;
+    for (;;) {
+        va_start(ap, fmt);
+        n = vsnprintf(b->p ? b->p + b->len : NULL, b->p ? b->cap - b->len : 0, fmt, ap);
+        va_end(ap);
+        if (n < 0) {
+            b->failed = 1;
+            return;
+        }
+        if (b->p && b->len + (size_t)n < b->cap) {
+            b->len += (size_t)n;
+            return;
+        }
+        size_t cap = b->cap ? b->cap * 2 : 65536;
+        while (cap <= b->len + (size_t)n) cap *= 2;
+        char *np = (char *)realloc(b->p, cap);
+        if (!np) {
+            b->failed = 1;
+            return;
+        }
+        b->p = np;
+        b->cap = cap;
+    }
+}
+
+/* Dumps every ring, oldest event first, in Chrome trace-event format (chrome://tracing, Perfetto). */
+static char *lp_trace_dump_json(void) {
+    lp_strbuf_t b = {0};
+    int first = 1;
+    lp_strbuf_appendf(&b, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    pthread_mutex_lock(&lp_trace_lock);
+    for (size_t i = 0; i < lp_trace_ring_count; i++) {
+        lp_trace_ring_t *ring = lp_trace_rings[i];
+        unsigned head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        unsigned count = head < LP_TRACE_RING ? head : LP_TRACE_RING;
+        lp_strbuf_appendf(&b, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+                          first ? "" : ",", ring->tid, ring->name);
+        first = 0;
+        for (unsigned k = head - count; k != head; k++) {
+            lp_trace_event_t e = ring->ev[k & (LP_TRACE_RING - 1)];
+            double ts_us = e.ts_ns > lp_trace_epoch_ns ? (double)(e.ts_ns - lp_trace_epoch_ns) / 1000.0 : 0.0;
+            if (e.id >= LP_TP_COUNT) continue;
+            lp_strbuf_appendf(&b, ",{\"name\":\"%s\",\"ph\":\"%c\",%s\"ts\":%.3f,\"pid\":1,\"tid\":%u,\"args\":{\"v\":%u}}",
+                              lp_tracepoint_names[e.id], e.ph, e.ph == 'i' ? "\"s\":\"t\"," : "",
+                              ts_us, ring->tid, e.arg);
+        }
+    }
+    pthread_mutex_unlock(&lp_trace_lock);
+    lp_strbuf_appendf(&b, "]}");
+    if (b.failed) {
+        free(b.p);
+        return NULL;
+    }
+    return b.p;
+}
+#endif
+
+static void lp_http_handle_trace(int fd, lp_http_req_t *req) {
+#if LP_TRACE
+    char *json;
+    if (strcmp(req->method, "GET") != 0) {
+        lp_http_send_err(fd, 405, "Method Not Allowed", "method_not_allowed");
+        return;
+    }
+    json = lp_trace_dump_json();
+    if (!json) {
+        lp_http_send_err(fd, 500, "Internal Server Error", "trace_dump_failed");
+        return;
+    }
+    (void)lp_http_send(fd, 200, "OK", json);
+    free(json);
+#else
+    (void)req;
+    lp_http_send_err(fd, 501, "Not Implemented", "trace_disabled");
+#endif
+}
+
 static void lp_http_handle(lp_app_t *app, int fd, lp_http_req_t *req) {
-    char json[1024];
+    char json[2048];
     char host[LP_MAX_HOST + 1] = {0};
     uint16_t port = 0;
+    int rc;
 
     if (!lp_http_authorized(app, req)) {
         lp_http_send_err(fd, 401, "Unauthorized", "unauthorized");
@@ -653,6 +2697,14 @@ static void lp_http_handle(lp_app_t *app, int fd, lp_http_req_t *req) {
         (void)lp_http_send(fd, 200, "OK", json);
         return;
     }
+    if (strcmp(req->path, "/routes") == 0) {
+        lp_http_handle_routes(app, fd, req);
+        return;
+    }
+    if (strcmp(req->path, "/debug/trace") == 0) {
+        lp_http_handle_trace(fd, req);
+        return;
+    }
 
     if (strcmp(req->method, "POST") == 0 &&
         (strcmp(req->path, "/proxy/start") == 0 || strcmp(req->path, "/proxy/toggle") == 0)) {
@@ -660,25 +2712,36 @@ static void lp_http_handle(lp_app_t *app, int fd, lp_http_req_t *req) {
     }
 
     if (strcmp(req->method, "POST") == 0 && strcmp(req->path, "/proxy/start") == 0) {
-        if (lp_runtime_start(app, host, port) != 0) {
+        pthread_mutex_lock(&app->rt.ctl_lock);
+        rc = lp_runtime_start(app, host, port);
+        pthread_mutex_unlock(&app->rt.ctl_lock);
+        if (rc != 0) {
             lp_http_send_err(fd, 500, "Internal Server Error", "start_failed");
             return;
         }
+        lp_snapshot_save(app);
         lp_status_json(app, json, sizeof(json));
         (void)lp_http_send(fd, 200, "OK", json);
         return;
     }
     if (strcmp(req->method, "POST") == 0 && strcmp(req->path, "/proxy/stop") == 0) {
+        pthread_mutex_lock(&app->rt.ctl_lock);
         (void)lp_runtime_stop(app);
+        pthread_mutex_unlock(&app->rt.ctl_lock);
+        lp_snapshot_save(app);
         lp_status_json(app, json, sizeof(json));
         (void)lp_http_send(fd, 200, "OK", json);
         return;
     }
     if (strcmp(req->method, "POST") == 0 && strcmp(req->path, "/proxy/toggle") == 0) {
-        if (lp_runtime_toggle(app, host, port) != 0) {
+        pthread_mutex_lock(&app->rt.ctl_lock);
+        rc = lp_runtime_toggle(app, host, port);
+        pthread_mutex_unlock(&app->rt.ctl_lock);
+        if (rc != 0) {
             lp_http_send_err(fd, 500, "Internal Server Error", "toggle_failed");
             return;
         }
+        lp_snapshot_save(app);
         lp_status_json(app, json, sizeof(json));
         (void)lp_http_send(fd, 200, "OK", json);
         return;
@@ -716,6 +2779,7 @@ static void lp_http_server(lp_app_t *app) {
         return;
     }
     lp_log("HTTP control server listening on http://%s:%u", app->cfg.control_bind_host, (unsigned)app->cfg.control_port);
+    LP_TP_ATTACH("http");
 
     for (;;) {
         int c = accept(s, NULL, NULL);
@@ -738,7 +2802,9 @@ static void lp_http_server(lp_app_t *app) {
             close(c);
             continue;
         }
+        LP_TP(LP_TP_HTTP, 'B', 0);
         lp_http_handle(app, c, &req);
+        LP_TP(LP_TP_HTTP, 'E', 0);
         close(c);
     }
 }
@@ -755,17 +2821,31 @@ int main(int argc, char **argv) {
         fprintf(stderr, "[luminaproxyd] failed to load config: %s\n", config_path);
         return 1;
     }
+    lp_memory_apply_limit(&app);
     lp_runtime_init(&app.rt, &app.cfg);
 
-    lp_log("deviceId=%s localProxyPort=%u remoteDefault=%s:%u",
+    lp_log("deviceId=%s localProxyPort=%u remoteDefault=%s:%u routes=%zu memoryLimit=%lluMB",
            app.cfg.device_id,
            (unsigned)app.cfg.local_proxy_port,
            app.cfg.remote_default_host[0] ? app.cfg.remote_default_host : "(unset)",
-           (unsigned)app.cfg.remote_default_port);
+           (unsigned)app.cfg.remote_default_port,
+           app.cfg.routes.count,
+           (unsigned long long)(app.memory_limit_bytes >> 20));
+    lp_snapshot_restore(&app);
+    lp_upkeep_start(&app);
+    lp_routes_publish(&app);
+    if (app.cfg.tunnel_mode == LP_TUNNEL_SERVER) (void)lp_tunnel_server_start(&app);
+    if (app.cfg.tunnel_mode == LP_TUNNEL_CLIENT) {
+        lp_log("Tunnel client -> udp://%s:%u (mtu=%ld batch=%ldus compress=%d dict=%zu bytes)",
+               app.cfg.tunnel_peer_host, (unsigned)app.cfg.tunnel_peer_port,
+               app.cfg.tunnel_mtu, app.cfg.tunnel_batch_us, app.cfg.tunnel_compress, app.cfg.tunnel_dict_len);
+    }
 
     lp_http_server(&app);
 
+    lp_upkeep_stop(&app);
     (void)lp_runtime_stop(&app);
     lp_runtime_destroy(&app.rt);
+    free(app.cfg.tunnel_dict);
     return 0;
 }
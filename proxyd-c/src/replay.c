@@ -0,0 +1,898 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * replay: feeds the UDP payloads of a pcapng/pcap capture through a running luminaproxyd
+ * relay against an in-process stand-in server, then reports pps, latency and CPU per stage.
+ *
+ *   client socket --(C2S)--> relay --(C2S)--> stand-in
+ *   client socket <--(S2C)-- relay <--(S2C)-- stand-in (echo, or the captured replies)
+ */
+
+#define RP_UDP_BUF 65535
+#define RP_MATCH_WINDOW 256
+#define RP_RECV_TIMEOUT_US 50000
+
+#define RP_PCAPNG_SHB 0x0A0D0D0Au
+#define RP_PCAPNG_IDB 0x00000001u
+#define RP_PCAPNG_SPB 0x00000003u
+#define RP_PCAPNG_EPB 0x00000006u
+#define RP_PCAPNG_BOM 0x1A2B3C4Du
+#define RP_MAX_IFACES 64
+#define RP_MAX_TASKS 32
+
+typedef enum {
+    RP_C2S = 0,
+    RP_S2C = 1
+} rp_dir_t;
+
+typedef struct {
+    uint64_t ts_ns;
+    size_t off;
+    uint32_t len;
+    rp_dir_t dir;
+} rp_event_t;
+
+typedef struct {
+    rp_event_t *events;
+    size_t count, cap;
+    unsigned char *arena;
+    size_t arena_len, arena_cap;
+    size_t skipped;
+} rp_capture_t;
+
+/* Datagrams sent on one path, published to the matching thread in order. */
+typedef struct {
+    uint64_t *hash;
+    uint32_t *len;
+    uint64_t *sent_ns;
+    uint64_t *lat_ns;
+    size_t cap;
+    atomic_size_t sent;
+    atomic_size_t delivered;
+    size_t cursor;
+} rp_path_t;
+
+typedef struct {
+    const char *capture_path;
+    char relay_host[256];
+    uint16_t relay_port;
+    uint16_t standin_port;
+    uint16_t server_port;
+    int script;
+    int fast;
+    double speed;
+    size_t window;
+    long drain_ms;
+    char control_host[256];
+    uint16_t control_port;
+    const char *token;
+    long relay_pid;
+} rp_opts_t;
+
+/* One relay thread: tid, comm name and on-CPU time from schedstat. */
+typedef struct {
+    long tid;
+    char name[16];
+    uint64_t cpu_ns;
+} rp_task_cpu_t;
+
+typedef struct {
+    rp_task_cpu_t task[RP_MAX_TASKS];
+    size_t count;
+} rp_tasks_t;
+
+typedef struct {
+    rp_opts_t opt;
+    rp_capture_t cap;
+    size_t *c2s;
+    size_t c2s_count;
+    size_t *script_begin;
+    size_t *script_end;
+    rp_path_t fwd;
+    rp_path_t ret;
+    size_t ret_expected;
+    int client_fd;
+    int standin_fd;
+    volatile int stop_flag;
+    uint64_t cpu_send_ns, cpu_standin_ns, cpu_recv_ns;
+    int control_active;
+    int prev_running;
+    char prev_host[256];
+    uint16_t prev_port;
+} rp_app_t;
+
+static volatile sig_atomic_t rp_interrupted;
+static rp_app_t *rp_restore_app;
+
+static void rp_die(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    fprintf(stderr, "[replay] ");
+    vfprintf(stderr, fmt, ap);
+    fprintf(stderr, "\n");
+    va_end(ap);
+    exit(1);
+}
+
+static void rp_on_signal(int sig) {
+    (void)sig;
+    rp_interrupted = 1;
+}
+
+static uint64_t rp_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t rp_thread_cpu_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void rp_sleep_ns(uint64_t ns) {
+    struct timespec ts;
+    ts.tv_sec = (time_t)(ns / 1000000000ULL);
+    ts.tv_nsec = (long)(ns % 1000000000ULL);
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {}
+}
+
+static uint64_t rp_fnv1a64(const unsigned char *p, size_t n) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < n; i++) {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static void *rp_xcalloc(size_t n, size_t sz) {
+    void *p = calloc(n ? n : 1, sz);
+    if (!p) rp_die("out of memory");
+    return p;
+}
+
+/* ---- capture parsing ---- */
+
+static uint16_t rp_rd16(const unsigned char *p, int swap) {
+    uint16_t v;
+    memcpy(&v, p, sizeof(v));
+    return swap ? (uint16_t)((v >> 8) | (v << 8)) : v;
+}
+
+static uint32_t rp_rd32(const unsigned char *p, int swap) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    if (swap) v = ((v >> 24) & 0xff) | ((v >> 8) & 0xff00) | ((v << 8) & 0xff0000) | (v << 24);
+    return v;
+}
+
+static uint16_t rp_be16(const unsigned char *p) {
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static void rp_capture_add(rp_capture_t *c, uint64_t ts_ns, rp_dir_t dir, const unsigned char *data, size_t len) {
+    rp_event_t *ev;
+    if (c->count == c->cap) {
+        c->cap = c->cap ? c->cap * 2 : 1024;
+        c->events = (rp_event_t *)realloc(c->events, c->cap * sizeof(*c->events));
+        if (!c->events) rp_die("out of memory");
+    }
+    while (c->arena_len + len > c->arena_cap) {
+        c->arena_cap = c->arena_cap ? c->arena_cap * 2 : (1u << 20);
+        c->arena = (unsigned char *)realloc(c->arena, c->arena_cap);
+        if (!c->arena) rp_die("out of memory");
+    }
+    ev = &c->events[c->count++];
+    ev->ts_ns = ts_ns;
+    ev->off = c->arena_len;
+    ev->len = (uint32_t)len;
+    ev->dir = dir;
+    memcpy(c->arena + c->arena_len, data, len);
+    c->arena_len += len;
+}
+
+/* Strips link + IP + UDP headers and keeps datagrams to/from the server port. */
+static void rp_capture_frame(rp_capture_t *c, uint16_t server_port, int linktype, uint64_t ts_ns,
+                             const unsigned char *p, size_t n) {
+    unsigned version;
+    size_t ip_len;
+    uint16_t sport, dport, ulen;
+
+    switch (linktype) {
+        case 1: { /* Ethernet, optionally 802.1Q tagged */
+            uint16_t type;
+            if (n < 14) goto skip;
+            type = rp_be16(p + 12);
+            p += 14;
+            n -= 14;
+            while (type == 0x8100 || type == 0x88a8) {
+                if (n < 4) goto skip;
+                type = rp_be16(p + 2);
+                p += 4;
+                n -= 4;
+            }
+            if (type != 0x0800 && type != 0x86dd) goto skip;
+            break;
+        }
+        case 0: /* BSD loopback: 4-byte address family in capture host order */
+        case 109:
+            if (n < 4) goto skip;
+            p += 4;
+            n -= 4;
+            break;
+        case 113: /* Linux cooked v1 */
+            if (n < 16) goto skip;
+            p += 16;
+            n -= 16;
+            break;
+        case 276: /* Linux cooked v2 */
+            if (n < 20) goto skip;
+            p += 20;
+            n -= 20;
+            break;
+        case 12:
+        case 101:
+        case 228:
+        case 229:
+            break;
+        default:
+            goto skip;
+    }
+
+    if (n < 1) goto skip;
+    version = p[0] >> 4;
+    if (version == 4) {
+        size_t ihl = (size_t)(p[0] & 0x0f) * 4;
+        if (n < 20 || ihl < 20 || n < ihl || p[9] != 17) goto skip;
+        if ((rp_be16(p + 6) & 0x1fff) != 0 || (rp_be16(p + 6) & 0x2000) != 0) goto skip; /* fragments */
+        ip_len = ihl;
+    } else if (version == 6) {
+        if (n < 40 || p[6] != 17) goto skip;
+        ip_len = 40;
+    } else {
+        goto skip;
+    }
+    p += ip_len;
+    n -= ip_len;
+    if (n < 8) goto skip;
+    sport = rp_be16(p);
+    dport = rp_be16(p + 2);
+    ulen = rp_be16(p + 4);
+    if (ulen < 8) goto skip;
+    if ((size_t)ulen - 8 < n - 8) n = (size_t)ulen;
+    if (dport == server_port) rp_capture_add(c, ts_ns, RP_C2S, p + 8, n - 8);
+    else if (sport == server_port) rp_capture_add(c, ts_ns, RP_S2C, p + 8, n - 8);
+    else goto skip;
+    return;
+
+skip:
+    c->skipped++;
+}
+
+static void rp_load_pcapng(rp_capture_t *c, uint16_t server_port, const unsigned char *buf, size_t len) {
+    int linktype[RP_MAX_IFACES];
+    uint64_t tsdiv_num[RP_MAX_IFACES], tsdiv_den[RP_MAX_IFACES];
+    size_t ifaces = 0, pos = 0;
+    uint64_t last_ts = 0;
+    int swap = 0;
+
+    while (pos + 12 <= len) {
+        uint32_t type = rp_rd32(buf + pos, swap);
+        uint32_t blen;
+        const unsigned char *body;
+        size_t body_len;
+
+        if (type == RP_PCAPNG_SHB) {
+            if (pos + 12 > len) break;
+            swap = rp_rd32(buf + pos + 8, 0) != RP_PCAPNG_BOM;
+            if (swap && rp_rd32(buf + pos + 8, 1) != RP_PCAPNG_BOM) rp_die("bad pcapng byte-order magic");
+            ifaces = 0;
+        }
+        blen = rp_rd32(buf + pos + 4, swap);
+        if (blen < 12 || (blen & 3) || pos + blen > len) rp_die("truncated pcapng block at offset %zu", pos);
+        body = buf + pos + 8;
+        body_len = blen - 12;
+
+        if (type == RP_PCAPNG_IDB && body_len >= 8 && ifaces < RP_MAX_IFACES) {
+            size_t o = 8;
+            linktype[ifaces] = rp_rd16(body, swap);
+            tsdiv_num[ifaces] = 1000;
+            tsdiv_den[ifaces] = 1; /* default if_tsresol = 10^-6 */
+            while (o + 4 <= body_len) {
+                uint16_t code = rp_rd16(body + o, swap), olen = rp_rd16(body + o + 2, swap);
+                if (code == 0 || o + 4 + olen > body_len) break;
+                if (code == 9 && olen >= 1) {
+                    unsigned char r = body[o + 4];
+                    uint64_t units = 1;
+                    for (unsigned i = 0; i < (r & 0x7f) && units < 1000000000000000000ULL; i++) units *= (r & 0x80) ? 2 : 10;
+                    tsdiv_num[ifaces] = 1000000000ULL;
+                    tsdiv_den[ifaces] = units;
+                }
+                o += 4 + ((olen + 3u) & ~3u);
+            }
+            ifaces++;
+        } else if (type == RP_PCAPNG_EPB && body_len >= 20) {
+            uint32_t ifid = rp_rd32(body, swap);
+            uint64_t raw = ((uint64_t)rp_rd32(body + 4, swap) << 32) | rp_rd32(body + 8, swap);
+            uint32_t caplen = rp_rd32(body + 12, swap);
+            if (ifid < ifaces && 20 + (size_t)caplen <= body_len) {
+                uint64_t den = tsdiv_den[ifid], num = tsdiv_num[ifid];
+                last_ts = (raw / den) * num + (raw % den) * num / den;
+                rp_capture_frame(c, server_port, linktype[ifid], last_ts, body + 20, caplen);
+            } else {
+                c->skipped++;
+            }
+        } else if (type == RP_PCAPNG_SPB && body_len >= 4 && ifaces > 0) {
+            /* Simple packets carry no timestamp; reuse the previous one. */
+            rp_capture_frame(c, server_port, linktype[0], last_ts, body + 4, body_len - 4);
+        }
+        pos += blen;
+    }
+}
+
+static void rp_load_pcap(rp_capture_t *c, uint16_t server_port, const unsigned char *buf, size_t len) {
+    uint32_t magic = rp_rd32(buf, 0);
+    int swap = (magic == 0xd4c3b2a1u || magic == 0x4d3cb2a1u);
+    int nano = (magic == 0xa1b23c4du || magic == 0x4d3cb2a1u);
+    int linktype = (int)(rp_rd32(buf + 20, swap) & 0xffff);
+    size_t pos = 24;
+    while (pos + 16 <= len) {
+        uint64_t sec = rp_rd32(buf + pos, swap), frac = rp_rd32(buf + pos + 4, swap);
+        uint32_t caplen = rp_rd32(buf + pos + 8, swap);
+        if (pos + 16 + caplen > len) break;
+        rp_capture_frame(c, server_port, linktype, sec * 1000000000ULL + (nano ? frac : frac * 1000ULL),
+                         buf + pos + 16, caplen);
+        pos += 16 + caplen;
+    }
+}
+
+static void rp_load_capture(rp_app_t *app) {
+    FILE *f = fopen(app->opt.capture_path, "rb");
+    unsigned char *buf;
+    long sz;
+    uint32_t magic;
+
+    if (!f) rp_die("cannot open %s: %s", app->opt.capture_path, strerror(errno));
+    if (fseek(f, 0, SEEK_END) != 0 || (sz = ftell(f)) < 24 || fseek(f, 0, SEEK_SET) != 0) rp_die("cannot read %s", app->opt.capture_path);
+    buf = (unsigned char *)rp_xcalloc((size_t)sz, 1);
+    if (fread(buf, 1, (size_t)sz, f) != (size_t)sz) rp_die("cannot read %s", app->opt.capture_path);
+    fclose(f);
+
+    magic = rp_rd32(buf, 0);
+    if (magic == RP_PCAPNG_SHB) rp_load_pcapng(&app->cap, app->opt.server_port, buf, (size_t)sz);
+    else if (magic == 0xa1b2c3d4u || magic == 0xd4c3b2a1u || magic == 0xa1b23c4du || magic == 0x4d3cb2a1u)
+        rp_load_pcap(&app->cap, app->opt.server_port, buf, (size_t)sz);
+    else rp_die("%s is not a pcapng/pcap capture", app->opt.capture_path);
+    free(buf);
+}
+
+/* Indexes client packets and, for script mode, the server replies that follow each of them. */
+static void rp_plan(rp_app_t *app) {
+    size_t k = 0;
+    app->c2s = (size_t *)rp_xcalloc(app->cap.count, sizeof(size_t));
+    for (size_t i = 0; i < app->cap.count; i++) {
+        if (app->cap.events[i].dir == RP_C2S) app->c2s[app->c2s_count++] = i;
+    }
+    app->script_begin = (size_t *)rp_xcalloc(app->c2s_count, sizeof(size_t));
+    app->script_end = (size_t *)rp_xcalloc(app->c2s_count, sizeof(size_t));
+    for (k = 0; k < app->c2s_count; k++) {
+        size_t next = (k + 1 < app->c2s_count) ? app->c2s[k + 1] : app->cap.count;
+        app->script_begin[k] = app->c2s[k] + 1;
+        app->script_end[k] = next;
+    }
+}
+
+/* ---- paths ---- */
+
+static void rp_path_init(rp_path_t *p, size_t cap) {
+    p->cap = cap;
+    p->hash = (uint64_t *)rp_xcalloc(cap, sizeof(uint64_t));
+    p->len = (uint32_t *)rp_xcalloc(cap, sizeof(uint32_t));
+    p->sent_ns = (uint64_t *)rp_xcalloc(cap, sizeof(uint64_t));
+    p->lat_ns = (uint64_t *)rp_xcalloc(cap, sizeof(uint64_t));
+    atomic_init(&p->sent, 0);
+    atomic_init(&p->delivered, 0);
+    p->cursor = 0;
+}
+
+static void rp_path_send(rp_path_t *p, int fd, const struct sockaddr *dst, socklen_t dst_len,
+                         const unsigned char *data, size_t len) {
+    size_t i = atomic_load_explicit(&p->sent, memory_order_relaxed);
+    if (i >= p->cap) return;
+    p->hash[i] = rp_fnv1a64(data, len);
+    p->len[i] = (uint32_t)len;
+    p->sent_ns[i] = rp_now_ns();
+    atomic_store_explicit(&p->sent, i + 1, memory_order_release);
+    (void)sendto(fd, data, len, 0, dst, dst_len);
+}
+
+/* Matches a received datagram to the oldest unmatched send with the same bytes; losses are skipped. */
+static void rp_path_deliver(rp_path_t *p, const unsigned char *data, size_t len, uint64_t now) {
+    size_t sent = atomic_load_explicit(&p->sent, memory_order_acquire);
+    uint64_t h = rp_fnv1a64(data, len);
+    for (size_t i = p->cursor; i < sent && i < p->cursor + RP_MATCH_WINDOW; i++) {
+        if (p->lat_ns[i] == 0 && p->hash[i] == h && p->len[i] == len) {
+            p->lat_ns[i] = (now > p->sent_ns[i]) ? now - p->sent_ns[i] : 1;
+            if (i == p->cursor) {
+                while (p->cursor < sent && p->lat_ns[p->cursor]) p->cursor++;
+            }
+            atomic_fetch_add_explicit(&p->delivered, 1, memory_order_release);
+            return;
+        }
+    }
+    if (sent > p->cursor + RP_MATCH_WINDOW) p->cursor = sent - RP_MATCH_WINDOW;
+}
+
+/* ---- threads ---- */
+
+static void *rp_standin_thread(void *arg) {
+    rp_app_t *app = (rp_app_t *)arg;
+    unsigned char buf[RP_UDP_BUF];
+    uint64_t cpu0 = rp_thread_cpu_ns();
+    size_t k = 0;
+
+    while (!app->stop_flag) {
+        struct sockaddr_storage src;
+        socklen_t src_len = sizeof(src);
+        ssize_t n = recvfrom(app->standin_fd, buf, sizeof(buf), 0, (struct sockaddr *)&src, &src_len);
+        if (n < 0) continue;
+        rp_path_deliver(&app->fwd, buf, (size_t)n, rp_now_ns());
+        if (!app->opt.script) {
+            rp_path_send(&app->ret, app->standin_fd, (struct sockaddr *)&src, src_len, buf, (size_t)n);
+        } else if (k < app->c2s_count) {
+            for (size_t i = app->script_begin[k]; i < app->script_end[k]; i++) {
+                const rp_event_t *ev = &app->cap.events[i];
+                rp_path_send(&app->ret, app->standin_fd, (struct sockaddr *)&src, src_len,
+                             app->cap.arena + ev->off, ev->len);
+            }
+            k++;
+        }
+    }
+    app->cpu_standin_ns = rp_thread_cpu_ns() - cpu0;
+    return NULL;
+}
+
+static void *rp_recv_thread(void *arg) {
+    rp_app_t *app = (rp_app_t *)arg;
+    unsigned char buf[RP_UDP_BUF];
+    uint64_t cpu0 = rp_thread_cpu_ns();
+
+    while (!app->stop_flag) {
+        ssize_t n = recv(app->client_fd, buf, sizeof(buf), 0);
+        if (n < 0) continue;
+        rp_path_deliver(&app->ret, buf, (size_t)n, rp_now_ns());
+    }
+    app->cpu_recv_ns = rp_thread_cpu_ns() - cpu0;
+    return NULL;
+}
+
+static void rp_send_all(rp_app_t *app) {
+    uint64_t cpu0 = rp_thread_cpu_ns();
+    uint64_t t0 = rp_now_ns();
+    uint64_t cap0 = app->c2s_count ? app->cap.events[app->c2s[0]].ts_ns : 0;
+
+    for (size_t k = 0; k < app->c2s_count && !rp_interrupted; k++) {
+        const rp_event_t *ev = &app->cap.events[app->c2s[k]];
+        if (!app->opt.fast) {
+            uint64_t due = t0 + (uint64_t)((double)(ev->ts_ns - cap0) / app->opt.speed);
+            uint64_t now = rp_now_ns();
+            if (due > now) rp_sleep_ns(due - now);
+        } else {
+            /* Bound in-flight datagrams so loopback socket buffers do not overflow. */
+            uint64_t waited = rp_now_ns();
+            while (k - atomic_load_explicit(&app->fwd.delivered, memory_order_acquire) >= app->opt.window &&
+                   rp_now_ns() - waited < 200000000ULL) {
+                rp_sleep_ns(10000);
+            }
+        }
+        rp_path_send(&app->fwd, app->client_fd, NULL, 0, app->cap.arena + ev->off, ev->len);
+    }
+    app->cpu_send_ns = rp_thread_cpu_ns() - cpu0;
+}
+
+/* Waits until every datagram came back, or neither path made progress for drain_ms. */
+static void rp_drain(rp_app_t *app) {
+    size_t last = (size_t)-1;
+    uint64_t idle_since = rp_now_ns();
+    for (;;) {
+        size_t now_cnt = atomic_load(&app->fwd.delivered) + atomic_load(&app->ret.delivered);
+        if (atomic_load(&app->fwd.delivered) == app->c2s_count &&
+            atomic_load(&app->ret.delivered) == app->ret_expected) {
+            return;
+        }
+        if (rp_interrupted) return;
+        if (now_cnt != last) {
+            last = now_cnt;
+            idle_since = rp_now_ns();
+        } else if (rp_now_ns() - idle_since > (uint64_t)app->opt.drain_ms * 1000000ULL) {
+            return;
+        }
+        rp_sleep_ns(1000000);
+    }
+}
+
+/* ---- setup ---- */
+
+static int rp_udp_socket(const char *host, uint16_t port, int do_bind) {
+    struct addrinfo hints, *res = NULL, *it;
+    struct timeval tv;
+    char port_s[16];
+    int fd = -1, rcvbuf = 4 << 20;
+    snprintf(port_s, sizeof(port_s), "%u", (unsigned)port);
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    if (getaddrinfo(host, port_s, &hints, &res) != 0) return -1;
+    for (it = res; it; it = it->ai_next) {
+        fd = socket(it->ai_family, it->ai_socktype, it->ai_protocol);
+        if (fd < 0) continue;
+        if ((do_bind ? bind(fd, it->ai_addr, it->ai_addrlen) : connect(fd, it->ai_addr, it->ai_addrlen)) == 0) break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd < 0) return -1;
+    tv.tv_sec = 0;
+    tv.tv_usec = RP_RECV_TIMEOUT_US;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    return fd;
+}
+
+/* One request to the relay's control API; returns the HTTP status and copies the body into resp. */
+static int rp_control_request(rp_app_t *app, const char *method, const char *path, const char *body,
+                              char *resp, size_t resp_sz) {
+    char req[1024], port_s[16], *hdr_end;
+    struct addrinfo hints, *res = NULL;
+    size_t len = 0;
+    ssize_t got;
+    int fd, n, status = 0;
+
+    n = snprintf(req, sizeof(req),
+                 "%s %s HTTP/1.1\r\nHost: %s\r\nAuthorization: Bearer %s\r\n"
+                 "Content-Type: application/json\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n%s",
+                 method, path, app->opt.control_host, app->opt.token ? app->opt.token : "", strlen(body), body);
+    snprintf(port_s, sizeof(port_s), "%u", (unsigned)app->opt.control_port);
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(app->opt.control_host, port_s, &hints, &res) != 0) return -1;
+    fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd < 0 || connect(fd, res->ai_addr, res->ai_addrlen) != 0) {
+        if (fd >= 0) close(fd);
+        freeaddrinfo(res);
+        return -1;
+    }
+    freeaddrinfo(res);
+    if (send(fd, req, (size_t)n, 0) != n) {
+        close(fd);
+        return -1;
+    }
+    while (len + 1 < resp_sz && (got = recv(fd, resp + len, resp_sz - 1 - len, 0)) > 0) len += (size_t)got;
+    close(fd);
+    resp[len] = '\0';
+    if (sscanf(resp, "HTTP/1.1 %d", &status) != 1) return -1;
+    hdr_end = strstr(resp, "\r\n\r\n");
+    if (hdr_end) memmove(resp, hdr_end + 4, strlen(hdr_end + 4) + 1);
+    return status;
+}
+
+/* Remembers the relay's state and target from /status, then points it at the stand-in. */
+static void rp_control_start(rp_app_t *app) {
+    char body[128], resp[4096];
+    const char *p;
+
+    if (rp_control_request(app, "GET", "/status", "", resp, sizeof(resp)) != 200) rp_die("cannot read relay /status");
+    app->prev_running = strstr(resp, "\"state\":\"running\"") != NULL;
+    if ((p = strstr(resp, "\"serverHost\":\"")) != NULL) {
+        size_t n;
+        p += strlen("\"serverHost\":\"");
+        n = strcspn(p, "\"");
+        if (n < sizeof(app->prev_host)) {
+            memcpy(app->prev_host, p, n);
+            app->prev_host[n] = '\0';
+        }
+        if ((p = strstr(p, "\"serverPort\":")) != NULL) app->prev_port = (uint16_t)strtol(p + 13, NULL, 10);
+    }
+
+    snprintf(body, sizeof(body), "{\"serverHost\":\"127.0.0.1\",\"serverPort\":%u}", (unsigned)app->opt.standin_port);
+    if (rp_control_request(app, "POST", "/proxy/start", body, resp, sizeof(resp)) != 200) rp_die("relay refused /proxy/start");
+    app->control_active = 1;
+    rp_sleep_ns(100000000ULL); /* relay thread binds asynchronously */
+}
+
+/* Puts the relay back where rp_control_start found it; the daemon persists its target across restarts. */
+static void rp_control_restore(rp_app_t *app) {
+    char body[384], resp[4096];
+    int status;
+
+    if (!app->control_active) return;
+    app->control_active = 0;
+    /* A stopped relay still remembers its target for the next bare /proxy/start, so restore that too. */
+    if (app->prev_host[0] && app->prev_port) {
+        snprintf(body, sizeof(body), "{\"serverHost\":\"%s\",\"serverPort\":%u}", app->prev_host, (unsigned)app->prev_port);
+        status = rp_control_request(app, "POST", "/proxy/start", body, resp, sizeof(resp));
+    } else {
+        status = 200;
+    }
+    if (status == 200 && !app->prev_running) status = rp_control_request(app, "POST", "/proxy/stop", "", resp, sizeof(resp));
+    if (status == 200) {
+        printf("control  relay restored to %s:%u (%s)\n", app->prev_host[0] ? app->prev_host : "(unset)",
+               (unsigned)app->prev_port, app->prev_running ? "running" : "stopped");
+    }
+    if (status != 200) {
+        fprintf(stderr, "[replay] could not restore the relay (HTTP %d); it still targets the stand-in\n", status);
+    }
+}
+
+/* Per-thread CPU time of the relay process in ns, from /proc/<pid>/task/<tid>/schedstat.
+ * The main thread runs the control server, so it is labelled "http". Returns 0 without /proc. */
+static int rp_relay_tasks(long pid, rp_tasks_t *out) {
+#ifdef __linux__
+    char path[96];
+    struct dirent *e;
+    DIR *d;
+    out->count = 0;
+    snprintf(path, sizeof(path), "/proc/%ld/task", pid);
+    d = opendir(path);
+    if (!d) return 0;
+    while ((e = readdir(d)) != NULL && out->count < RP_MAX_TASKS) {
+        rp_task_cpu_t *t = &out->task[out->count];
+        unsigned long long ns = 0;
+        FILE *f;
+        int ok;
+        if (e->d_name[0] == '.') continue;
+        t->tid = strtol(e->d_name, NULL, 10);
+        snprintf(path, sizeof(path), "/proc/%ld/task/%ld/schedstat", pid, t->tid);
+        if (!(f = fopen(path, "r"))) continue;
+        ok = fscanf(f, "%llu", &ns) == 1;
+        fclose(f);
+        if (!ok) continue;
+        t->cpu_ns = ns;
+        snprintf(t->name, sizeof(t->name), "http");
+        if (t->tid != pid) {
+            snprintf(path, sizeof(path), "/proc/%ld/task/%ld/comm", pid, t->tid);
+            if ((f = fopen(path, "r")) != NULL) {
+                if (fgets(t->name, sizeof(t->name), f)) t->name[strcspn(t->name, "\n")] = '\0';
+                fclose(f);
+            }
+        }
+        out->count++;
+    }
+    closedir(d);
+    return out->count > 0;
+#else
+    (void)pid;
+    out->count = 0;
+    return 0;
+#endif
+}
+
+/* Prints CPU time spent between two samples, summed per thread name (a restarted relay gets a new tid). */
+static void rp_report_tasks(const rp_tasks_t *before, const rp_tasks_t *after) {
+    char names[RP_MAX_TASKS][16];
+    uint64_t sums[RP_MAX_TASKS];
+    size_t n = 0;
+    for (size_t i = 0; i < after->count; i++) {
+        const rp_task_cpu_t *t = &after->task[i];
+        uint64_t base = 0;
+        size_t k;
+        for (size_t j = 0; j < before->count; j++) {
+            if (before->task[j].tid == t->tid) base = before->task[j].cpu_ns;
+        }
+        for (k = 0; k < n && strcmp(names[k], t->name) != 0; k++) {}
+        if (k == n) {
+            memcpy(names[n], t->name, sizeof(names[n]));
+            sums[n++] = 0;
+        }
+        sums[k] += t->cpu_ns >= base ? t->cpu_ns - base : 0;
+    }
+    printf("relay_ms");
+    for (size_t k = 0; k < n; k++) printf(" %s=%.3f", names[k], (double)sums[k] / 1e6);
+    printf("\n");
+}
+
+/* ---- report ---- */
+
+static int rp_cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void rp_report_path(const char *name, rp_path_t *p, double wall_s) {
+    size_t sent = atomic_load(&p->sent), n = 0;
+    uint64_t *lat = (uint64_t *)rp_xcalloc(sent, sizeof(uint64_t));
+    static const double q[] = {0.50, 0.90, 0.99, 0.999};
+
+    for (size_t i = 0; i < sent; i++) {
+        if (p->lat_ns[i]) lat[n++] = p->lat_ns[i];
+    }
+    qsort(lat, n, sizeof(lat[0]), rp_cmp_u64);
+    printf("%-8s sent=%zu delivered=%zu lost=%zu pps=%.0f\n", name, sent, n, sent - n, wall_s > 0 ? (double)n / wall_s : 0.0);
+    if (n) {
+        printf("         latency_us");
+        for (size_t i = 0; i < sizeof(q) / sizeof(q[0]); i++) {
+            size_t idx = (size_t)(q[i] * (double)(n - 1));
+            printf(" p%g=%.1f", q[i] * 100.0, (double)lat[idx] / 1000.0);
+        }
+        printf(" max=%.1f\n", (double)lat[n - 1] / 1000.0);
+    }
+    free(lat);
+}
+
+static void rp_usage(void) {
+    fprintf(stderr,
+            "Usage: replay [options] <capture.pcapng>\n"
+            "\n"
+            "Replays the UDP payloads of a capture through a running luminaproxyd relay against\n"
+            "an in-process stand-in server and reports pps, latency and CPU time per stage.\n"
+            "\n"
+            "Options:\n"
+            "  --relay HOST:PORT        relay listen address (default 127.0.0.1:19132)\n"
+            "  --standin-port PORT      stand-in server port on 127.0.0.1 (default 19140)\n"
+            "  --server-port PORT       server port in the capture (default 19132)\n"
+            "  --mode echo|script       echo each client datagram, or send the captured replies (default echo)\n"
+            "  --timing original|fast   keep capture timing, or send as fast as the window allows (default original)\n"
+            "  --speed X                time scale for original timing (default 1.0)\n"
+            "  --window N               max in-flight client datagrams in fast mode (default 64)\n"
+            "  --drain-ms MS            stop after MS without progress (default 1000)\n"
+            "  --control HOST:PORT      POST /proxy/start to point the relay at the stand-in first\n"
+            "  --token TOKEN            bearer token for --control\n"
+            "  --relay-pid PID          also report the relay's CPU time per thread (Linux /proc)\n");
+}
+
+static void rp_parse_hostport(const char *s, char *host, size_t host_sz, uint16_t *port) {
+    const char *colon = strrchr(s, ':');
+    long v;
+    if (!colon || (size_t)(colon - s) >= host_sz) rp_die("expected HOST:PORT, got %s", s);
+    memcpy(host, s, (size_t)(colon - s));
+    host[colon - s] = '\0';
+    v = strtol(colon + 1, NULL, 10);
+    if (v <= 0 || v > 65535) rp_die("invalid port in %s", s);
+    *port = (uint16_t)v;
+}
+
+static uint16_t rp_parse_port(const char *s) {
+    long v = strtol(s, NULL, 10);
+    if (v <= 0 || v > 65535) rp_die("invalid port %s", s);
+    return (uint16_t)v;
+}
+
+static void rp_parse_args(rp_opts_t *o, int argc, char **argv) {
+    memset(o, 0, sizeof(*o));
+    strcpy(o->relay_host, "127.0.0.1");
+    o->relay_port = 19132;
+    o->standin_port = 19140;
+    o->server_port = 19132;
+    o->speed = 1.0;
+    o->window = 64;
+    o->drain_ms = 1000;
+    for (int i = 1; i < argc; i++) {
+        const char *a = argv[i];
+        const char *v = (i + 1 < argc) ? argv[i + 1] : NULL;
+        if (strcmp(a, "-h") == 0 || strcmp(a, "--help") == 0) {
+            rp_usage();
+            exit(0);
+        }
+        if (a[0] != '-') {
+            o->capture_path = a;
+            continue;
+        }
+        if (!v) rp_die("missing value for %s", a);
+        i++;
+        if (strcmp(a, "--relay") == 0) rp_parse_hostport(v, o->relay_host, sizeof(o->relay_host), &o->relay_port);
+        else if (strcmp(a, "--standin-port") == 0) o->standin_port = rp_parse_port(v);
+        else if (strcmp(a, "--server-port") == 0) o->server_port = rp_parse_port(v);
+        else if (strcmp(a, "--mode") == 0) o->script = strcmp(v, "script") == 0;
+        else if (strcmp(a, "--timing") == 0) o->fast = strcmp(v, "fast") == 0;
+        else if (strcmp(a, "--speed") == 0) o->speed = strtod(v, NULL);
+        else if (strcmp(a, "--window") == 0) o->window = (size_t)strtoul(v, NULL, 10);
+        else if (strcmp(a, "--drain-ms") == 0) o->drain_ms = strtol(v, NULL, 10);
+        else if (strcmp(a, "--control") == 0) rp_parse_hostport(v, o->control_host, sizeof(o->control_host), &o->control_port);
+        else if (strcmp(a, "--token") == 0) o->token = v;
+        else if (strcmp(a, "--relay-pid") == 0) o->relay_pid = strtol(v, NULL, 10);
+        else rp_die("unknown option %s", a);
+    }
+    if (!o->capture_path) {
+        rp_usage();
+        exit(2);
+    }
+    if (o->speed <= 0) o->speed = 1.0;
+    if (o->window == 0) o->window = 1;
+}
+
+static void rp_restore_at_exit(void) {
+    if (rp_restore_app) rp_control_restore(rp_restore_app);
+}
+
+int main(int argc, char **argv) {
+    static rp_app_t app;
+    pthread_t standin, receiver;
+    static rp_tasks_t relay_cpu0, relay_cpu1;
+    uint64_t t0, t1;
+    int relay_cpu_ok = 0;
+    size_t scripted = 0;
+    double wall_s, cap_s = 0;
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, rp_on_signal);
+    signal(SIGTERM, rp_on_signal);
+    rp_parse_args(&app.opt, argc, argv);
+    rp_load_capture(&app);
+    rp_plan(&app);
+    if (app.c2s_count == 0) rp_die("no client->server datagrams for port %u in capture", (unsigned)app.opt.server_port);
+    for (size_t k = 0; k < app.c2s_count; k++) scripted += app.script_end[k] - app.script_begin[k];
+    if (app.cap.count > 1) cap_s = (double)(app.cap.events[app.cap.count - 1].ts_ns - app.cap.events[0].ts_ns) / 1e9;
+
+    printf("capture  %s: %zu datagrams (c2s=%zu s2c=%zu skipped=%zu) over %.3fs\n",
+           app.opt.capture_path, app.cap.count, app.c2s_count, app.cap.count - app.c2s_count, app.cap.skipped, cap_s);
+
+    rp_path_init(&app.fwd, app.c2s_count);
+    app.ret_expected = app.opt.script ? scripted : app.c2s_count;
+    rp_path_init(&app.ret, app.ret_expected);
+    app.standin_fd = rp_udp_socket("127.0.0.1", app.opt.standin_port, 1);
+    if (app.standin_fd < 0) rp_die("cannot bind stand-in 127.0.0.1:%u", (unsigned)app.opt.standin_port);
+    if (app.opt.control_port) {
+        rp_control_start(&app);
+        rp_restore_app = &app;
+        atexit(rp_restore_at_exit); /* rp_die() after this point still restores the relay */
+    }
+    app.client_fd = rp_udp_socket(app.opt.relay_host, app.opt.relay_port, 0);
+    if (app.client_fd < 0) rp_die("cannot reach relay %s:%u", app.opt.relay_host, (unsigned)app.opt.relay_port);
+
+    if (pthread_create(&standin, NULL, rp_standin_thread, &app) != 0 ||
+        pthread_create(&receiver, NULL, rp_recv_thread, &app) != 0) {
+        rp_die("cannot start threads");
+    }
+
+    if (app.opt.relay_pid) relay_cpu_ok = rp_relay_tasks(app.opt.relay_pid, &relay_cpu0);
+    t0 = rp_now_ns();
+    rp_send_all(&app);
+    rp_drain(&app);
+    t1 = rp_now_ns();
+    if (relay_cpu_ok) relay_cpu_ok = rp_relay_tasks(app.opt.relay_pid, &relay_cpu1);
+    app.stop_flag = 1;
+    pthread_join(standin, NULL);
+    pthread_join(receiver, NULL);
+
+    wall_s = (double)(t1 - t0) / 1e9;
+    if (app.opt.fast) {
+        printf("replay   mode=%s timing=fast window=%zu wall=%.3fs\n",
+               app.opt.script ? "script" : "echo", app.opt.window, wall_s);
+    } else {
+        printf("replay   mode=%s timing=original speed=%g wall=%.3fs\n",
+               app.opt.script ? "script" : "echo", app.opt.speed, wall_s);
+    }
+    rp_report_path("forward", &app.fwd, wall_s);
+    rp_report_path("return", &app.ret, wall_s);
+    printf("cpu_ms   client_send=%.2f standin=%.2f client_recv=%.2f\n",
+           (double)app.cpu_send_ns / 1e6, (double)app.cpu_standin_ns / 1e6, (double)app.cpu_recv_ns / 1e6);
+    if (relay_cpu_ok) rp_report_tasks(&relay_cpu0, &relay_cpu1);
+    else if (app.opt.relay_pid) printf("relay_ms n/a\n");
+
+    rp_control_restore(&app);
+    close(app.client_fd);
+    close(app.standin_fd);
+    return (atomic_load(&app.fwd.delivered) == atomic_load(&app.fwd.sent)) ? 0 : 3;
+}